@@ -0,0 +1,188 @@
+// Stress test for the AC task inbox: a "HomeKit" thread and an "IR remote"
+// thread post as fast as they can while an owner thread takes and applies
+// inputs the way ac_task does. Checks that no remote state is torn, no
+// input goes backwards and the final state matches the last write.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "ac_inbox.h"
+#include "check.h"
+
+
+#define POSTS 200000
+
+
+static ac_inbox_t inbox;
+static volatile bool homekit_done, remote_done;
+static uint64_t max_post_ns;
+
+
+// All fields are derived from one counter, so a state assembled from two
+// different posts is detectable
+static fujitsu_ac_packed_state_t remote_state(uint32_t n) {
+    uint32_t k = n % 15;
+    fujitsu_ac_state_t state = {
+        .command = ac_cmd_turn_on,
+        .temperature = AC_MIN_TEMPERATURE + k,
+        .mode = k % 5,
+        .fan = k % 5,
+        .swing = k % 4,
+    };
+    return fujitsu_ac_state_pack(&state);
+}
+
+static bool remote_state_valid(const fujitsu_ac_state_t *state) {
+    uint32_t k = state->temperature - AC_MIN_TEMPERATURE;
+    return state->command == ac_cmd_turn_on && k < 15 &&
+        state->mode == k % 5 && state->fan == k % 5 && state->swing == k % 4;
+}
+
+
+static void *homekit_thread(void *_args) {
+    for (uint32_t i=1; i <= POSTS; i++) {
+        ac_input_t input = (i & 1) ? ac_input_target_temperature : ac_input_fan_swing_mode;
+        ac_input_value_t value;
+        if (input == ac_input_target_temperature)
+            value.float_value = i;
+        else
+            value.int_value = i;
+
+        uint64_t start = now_ns();
+        ac_inbox_post(&inbox, input, &value);
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed > max_post_ns)
+            max_post_ns = elapsed;
+
+        // Give the owner a chance to interleave with us
+        if ((i & 0x3f) == 0)
+            sched_yield();
+    }
+
+    homekit_done = true;
+    return NULL;
+}
+
+
+static void *remote_thread(void *_args) {
+    for (uint32_t i=1; i <= POSTS; i++) {
+        ac_input_value_t value = {.ac_state = remote_state(i)};
+        ac_inbox_post(&inbox, ac_input_remote, &value);
+
+        if ((i & 0x3f) == 0)
+            sched_yield();
+    }
+
+    remote_done = true;
+    return NULL;
+}
+
+
+typedef struct {
+    float temperature;
+    int swing;
+    uint32_t takes;
+    uint32_t superseded;
+    uint32_t last_seq[ac_input_count];
+    float last_temperature;
+    int last_swing;
+} owner_state_t;
+
+
+static void owner_apply(owner_state_t *owner, ac_inbox_t *inputs, uint32_t pending) {
+    owner->takes++;
+
+    for (int i=0; i < ac_input_count; i++) {
+        if (!(pending & AC_INPUT_BIT(i)))
+            continue;
+
+        CHECK((int32_t)(inputs->input_seq[i] - owner->last_seq[i]) > 0,
+              "input %d went backwards: seq %u after %u", i, inputs->input_seq[i], owner->last_seq[i]);
+        owner->last_seq[i] = inputs->input_seq[i];
+    }
+
+    if (pending & AC_INPUT_BIT(ac_input_remote)) {
+        fujitsu_ac_state_t unpacked;
+        fujitsu_ac_state_unpack(inputs->values[ac_input_remote].ac_state, &unpacked);
+        fujitsu_ac_state_t *state = &unpacked;
+        CHECK(remote_state_valid(state), "torn remote state: t=%d mode=%d fan=%d swing=%d",
+              state->temperature, state->mode, state->fan, state->swing);
+
+        owner->temperature = state->temperature;
+        owner->swing = state->swing;
+    }
+
+    if (pending & AC_INPUT_BIT(ac_input_target_temperature)) {
+        float value = inputs->values[ac_input_target_temperature].float_value;
+        CHECK(value > owner->last_temperature, "HomeKit temperature went backwards: %g after %g",
+              value, owner->last_temperature);
+        owner->last_temperature = value;
+
+        if (ac_inbox_superseded(inputs, ac_input_target_temperature))
+            owner->superseded++;
+        else
+            owner->temperature = value;
+    }
+
+    if (pending & AC_INPUT_BIT(ac_input_fan_swing_mode)) {
+        int value = inputs->values[ac_input_fan_swing_mode].int_value;
+        CHECK(value > owner->last_swing, "HomeKit swing went backwards: %d after %d",
+              value, owner->last_swing);
+        owner->last_swing = value;
+
+        if (ac_inbox_superseded(inputs, ac_input_fan_swing_mode))
+            owner->superseded++;
+        else
+            owner->swing = value;
+    }
+}
+
+
+int main() {
+    ac_inbox_init(&inbox);
+
+    pthread_t homekit, remote;
+    pthread_create(&homekit, NULL, homekit_thread, NULL);
+    pthread_create(&remote, NULL, remote_thread, NULL);
+
+    owner_state_t owner = {0};
+    ac_inbox_t inputs;
+    while (true) {
+        bool done = homekit_done && remote_done;
+
+        uint32_t pending = ac_inbox_take(&inbox, &inputs);
+        if (pending)
+            owner_apply(&owner, &inputs, pending);
+        else if (done)
+            break;
+    }
+
+    pthread_join(homekit, NULL);
+    pthread_join(remote, NULL);
+
+    // Whatever was written last must win
+    bool remote_last_temperature =
+        (int32_t)(inbox.input_seq[ac_input_remote] - inbox.input_seq[ac_input_target_temperature]) > 0;
+    bool remote_last_swing =
+        (int32_t)(inbox.input_seq[ac_input_remote] - inbox.input_seq[ac_input_fan_swing_mode]) > 0;
+
+    fujitsu_ac_state_t last_remote;
+    fujitsu_ac_state_unpack(remote_state(POSTS), &last_remote);
+    float expected_temperature = remote_last_temperature ? last_remote.temperature : POSTS - 1;
+    int expected_swing = remote_last_swing ? last_remote.swing : POSTS;
+
+    CHECK(owner.temperature == expected_temperature, "final temperature %g, expected %g",
+          owner.temperature, expected_temperature);
+    CHECK(owner.swing == expected_swing, "final swing %d, expected %d",
+          owner.swing, expected_swing);
+
+    printf("ac_inbox stress: %u posts, %u takes, %u superseded HomeKit inputs, "
+           "max post %.1f us, %d failures\n",
+           2 * POSTS, owner.takes, owner.superseded, max_post_ns / 1000.0, failures);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,195 @@
+// Runs the AC schedule against a simulated AC with its own timer for a
+// week of random events, remote presses and cancels, the way ac_task
+// drives it. Checks that the schedule always knows whether AC's timer
+// holds its next event, so that every event is carried out exactly once:
+// by AC's timer or by a frame sent when it is due.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ac_schedule.h"
+#include "check.h"
+
+
+#define MINUTE AC_SCHEDULE_MINUTE
+#define WEEK (7 * 24 * 60 * MINUTE)
+
+
+// AC's own timer: any turn off or full state frame stops it, one with a
+// timer sets it again
+typedef struct {
+    bool set;
+    bool on;
+    uint32_t time;
+    uint32_t fired;
+} ac_t;
+
+static void ac_receive(ac_t *ac, uint32_t now, fujitsu_ac_packed_state_t state,
+                       const fujitsu_ac_timer_t *timer) {
+    uint8_t command = state >> 24;
+    if (command && command != ac_cmd_turn_off)
+        return;
+
+    ac->set = !command && timer && timer->type != ac_timer_none;
+    if (ac->set) {
+        ac->on = (timer->type == ac_timer_on);
+        ac->time = now + (ac->on ? timer->on_minutes : timer->off_minutes) * MINUTE;
+    }
+}
+
+static void ac_tick(ac_t *ac, uint32_t now) {
+    if (ac->set && (int32_t)(now - ac->time) >= 0) {
+        ac->set = false;
+        ac->fired++;
+    }
+}
+
+static void push(ac_schedule_t *schedule, ac_t *ac, uint32_t now) {
+    fujitsu_ac_timer_t timer = ac_schedule_timer(schedule, now);
+    fujitsu_ac_state_t state = {.command = ac_cmd_stay_on, .mode = ac_mode_auto,
+                                .fan = ac_fan_auto, .temperature = 22};
+    fujitsu_ac_packed_state_t packed = fujitsu_ac_state_pack(&state);
+
+    ac_receive(ac, now, packed, &timer);
+    ac_schedule_frame(schedule, packed, &timer);
+}
+
+// Remote press: a full state frame, a turn off or a louver step
+static fujitsu_ac_packed_state_t remote_press(int kind) {
+    fujitsu_ac_state_t state = {.mode = ac_mode_cool, .fan = ac_fan_auto, .temperature = 24};
+    switch (kind) {
+    case 0: state.command = ac_cmd_stay_on; break;
+    case 1: state.command = ac_cmd_turn_off; break;
+    default: state.command = ac_cmd_step_vert; break;
+    }
+    return fujitsu_ac_state_pack(&state);
+}
+
+
+// One remote press between arming and the event: timer must be put back
+static void check_remote_press(int kind) {
+    ac_schedule_t schedule;
+    ac_schedule_init(&schedule);
+    ac_t ac = {0};
+
+    uint32_t now = 0;
+    ac_schedule_add(&schedule, now, 30);
+    CHECK(ac_schedule_stale(&schedule, now), "new event not pushed");
+    push(&schedule, &ac, now);
+    CHECK(schedule.timer_armed && ac.set, "event not in AC timer");
+
+    now += 10 * MINUTE;
+    fujitsu_ac_packed_state_t state = remote_press(kind);
+    ac_receive(&ac, now, state, NULL);
+    ac_schedule_frame(&schedule, state, NULL);
+    CHECK(schedule.timer_armed == ac.set, "remote press %d: armed %d, AC timer %d",
+          kind, schedule.timer_armed, ac.set);
+    CHECK(ac_schedule_stale(&schedule, now) == !ac.set, "remote press %d: stale %d",
+          kind, ac_schedule_stale(&schedule, now));
+
+    if (ac_schedule_stale(&schedule, now))
+        push(&schedule, &ac, now);
+
+    now += 20 * MINUTE;
+    ac_tick(&ac, now);
+
+    ac_event_t event;
+    bool by_timer;
+    CHECK(ac_schedule_take(&schedule, now, &event, &by_timer) && event.on,
+          "remote press %d: event not due", kind);
+    CHECK(by_timer && ac.fired == 1, "remote press %d: by timer %d, AC fired %u",
+          kind, by_timer, ac.fired);
+}
+
+// Events beyond timer range wait outside of it
+static void check_out_of_range() {
+    ac_schedule_t schedule;
+    ac_schedule_init(&schedule);
+
+    uint32_t now = 0;
+    ac_schedule_add(&schedule, now, -(FUJITSU_AC_TIMER_MAX_MINUTES + 60));
+    CHECK(ac_schedule_timer(&schedule, now).type == ac_timer_none, "out of range event in timer");
+    CHECK(!ac_schedule_stale(&schedule, now), "out of range event pushed");
+    CHECK(ac_schedule_wait(&schedule, now) == 60 * MINUTE, "waits %u ms to get in range",
+          ac_schedule_wait(&schedule, now));
+
+    now += 60 * MINUTE;
+    fujitsu_ac_timer_t timer = ac_schedule_timer(&schedule, now);
+    CHECK(timer.type == ac_timer_off && timer.off_minutes == FUJITSU_AC_TIMER_MAX_MINUTES,
+          "in range event: timer %d %u", timer.type, timer.off_minutes);
+    CHECK(ac_schedule_stale(&schedule, now), "in range event not pushed");
+
+    CHECK(ac_schedule_add(&schedule, now, 0) && !schedule.count, "cancel kept events");
+    CHECK(!ac_schedule_stale(&schedule, now), "cancel of unarmed timer pushed");
+}
+
+static void simulate() {
+    ac_schedule_t schedule;
+    ac_schedule_init(&schedule);
+    ac_t ac = {0};
+
+    srand(1);
+    uint32_t added = 0, cancelled = 0, presses = 0, pushes = 0, by_frame = 0;
+    for (uint32_t now=0; now < WEEK; now += MINUTE) {
+        uint32_t fired = ac.fired;
+        ac_tick(&ac, now);
+
+        // Firmware's turn: events that are due first, like ac_unit_serve()
+        ac_event_t event;
+        bool by_timer;
+        while (ac_schedule_take(&schedule, now, &event, &by_timer)) {
+            CHECK(by_timer == (ac.fired != fired), "%u: by timer %d, AC fired %d",
+                  now / MINUTE, by_timer, ac.fired != fired);
+            fired = ac.fired;
+            if (!by_timer) {
+                // Sent as a full state frame without timer
+                ac_receive(&ac, now, remote_press(event.on ? 0 : 1), NULL);
+                ac_schedule_frame(&schedule, remote_press(event.on ? 0 : 1), NULL);
+                by_frame++;
+            }
+        }
+        CHECK(ac.fired == fired, "%u: AC timer fired for no event", now / MINUTE);
+
+        int dice = rand() % 100;
+        if (dice < 5) {
+            int minutes = 1 + rand() % 120;
+            if (ac_schedule_add(&schedule, now, (rand() % 2) ? minutes : -minutes))
+                added++;
+        } else if (dice < 6) {
+            ac_schedule_add(&schedule, now, 0);
+            cancelled++;
+        } else if (dice < 16) {
+            fujitsu_ac_packed_state_t state = remote_press(rand() % 3);
+            ac_receive(&ac, now, state, NULL);
+            ac_schedule_frame(&schedule, state, NULL);
+            presses++;
+        }
+
+        if (ac_schedule_stale(&schedule, now)) {
+            push(&schedule, &ac, now);
+            pushes++;
+        }
+
+        CHECK(schedule.timer_armed == ac.set, "%u: armed %d, AC timer %d",
+              now / MINUTE, schedule.timer_armed, ac.set);
+        if (ac.set)
+            CHECK(schedule.count && ac.on == schedule.events[0].on &&
+                  ac.time == schedule.events[0].time, "%u: AC timer holds another event",
+                  now / MINUTE);
+    }
+
+    printf("ac schedule: %u events, %u cancels, %u remote presses, %u timer frames, "
+           "%u done by AC timer, %u by frame, %d failures\n",
+           added, cancelled, presses, pushes, ac.fired, by_frame, failures);
+}
+
+
+int main() {
+    for (int kind=0; kind < 3; kind++)
+        check_remote_press(kind);
+    check_out_of_range();
+    simulate();
+
+    return failures ? 1 : 0;
+}
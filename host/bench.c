@@ -0,0 +1,662 @@
+// Host benchmark for the Fujitsu AC codec: encodes every reachable state of
+// every model, feeds the rendered pulses back through the decoder and reports
+// per-frame cost, pulse buffer size and round-trip failures.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <ir/ir.h>
+#include <ir/generic.h>
+#include "fujitsu_ac_ir.h"
+#include "ir_dispatch.h"
+#include "check.h"
+
+
+#define countof(x) (sizeof(x) / sizeof(*x))
+
+
+typedef struct {
+    fujitsu_ac_model model;
+    const char *name;
+} model_info_t;
+
+static const model_info_t models[] = {
+    {fujitsu_ac_model_ARRAH2E, "ARRAH2E"},
+    {fujitsu_ac_model_ARDB1, "ARDB1"},
+};
+
+
+typedef struct {
+    uint32_t frames;
+    uint64_t encode_ns;
+    uint64_t decode_ns;
+    uint32_t pulse_bytes_min;
+    uint32_t pulse_bytes_max;
+    uint32_t encode_failures;
+    uint32_t decode_failures;
+    uint32_t mismatches;
+    uint32_t echo_failures;
+    uint64_t repeat_ns;
+    uint32_t repeat_frames;
+    uint32_t repeat_hits;
+    fujitsu_ac_ir_stats_t stats;
+} bench_result_t;
+
+
+static FILE *report;
+
+
+static size_t enumerate_states(fujitsu_ac_packed_state_t *states, size_t max_states) {
+    static const ac_cmd short_commands[] = {ac_cmd_turn_off, ac_cmd_step_horiz, ac_cmd_step_vert};
+    static const ac_cmd full_commands[] = {ac_cmd_stay_on, ac_cmd_turn_on};
+
+    fujitsu_ac_state_t state;
+
+    size_t count = 0;
+    for (size_t i=0; i < countof(short_commands) && count < max_states; i++) {
+        memset(&state, 0, sizeof(state));
+        state.command = short_commands[i];
+        states[count++] = fujitsu_ac_state_pack(&state);
+    }
+
+    for (size_t c=0; c < countof(full_commands); c++)
+        for (int mode=ac_mode_auto; mode <= ac_mode_heat; mode++)
+            for (int fan=ac_fan_auto; fan <= ac_fan_quiet; fan++)
+                for (int swing=ac_swing_off; swing <= ac_swing_both; swing++)
+                    for (int t=AC_MIN_TEMPERATURE; t <= AC_MAX_TEMPERATURE; t++) {
+                        if (count >= max_states)
+                            return count;
+
+                        state.command = full_commands[c];
+                        state.mode = mode;
+                        state.fan = fan;
+                        state.swing = swing;
+                        state.temperature = t;
+                        states[count++] = fujitsu_ac_state_pack(&state);
+                    }
+
+    return count;
+}
+
+
+// Packed state must survive unpacking, and the 16-bit trace form must
+// expand back to it. Returns number of states that do not.
+static uint32_t check_packing(fujitsu_ac_packed_state_t *states, size_t state_count) {
+    uint32_t failures = 0;
+    for (size_t i=0; i < state_count; i++) {
+        fujitsu_ac_state_t state;
+        fujitsu_ac_state_unpack(states[i], &state);
+        if (fujitsu_ac_state_pack(&state) != states[i] ||
+                fujitsu_ac_state_expand(fujitsu_ac_state_compact(states[i])) != states[i])
+            failures++;
+    }
+
+    return failures;
+}
+
+
+// Remote sets a state, HomeKit then asks for the same one: nothing has to
+// be sent. Any other difference has to be. Returns number of pairs judged
+// wrong.
+static uint32_t check_suppression(fujitsu_ac_packed_state_t *states, size_t state_count) {
+    uint32_t failures = 0;
+    for (size_t i=0; i < state_count; i++) {
+        fujitsu_ac_state_t state;
+        fujitsu_ac_state_unpack(states[i], &state);
+        if (state.command != ac_cmd_stay_on)
+            continue;
+
+        // what ac_update_state() builds from the same characteristics
+        fujitsu_ac_state_t homekit = state;
+        homekit.command = ac_cmd_turn_on;
+        if (!fujitsu_ac_state_same(states[i], fujitsu_ac_state_pack(&homekit)))
+            failures++;
+
+        for (size_t j=0; j < state_count; j++) {
+            fujitsu_ac_state_t other;
+            fujitsu_ac_state_unpack(states[j], &other);
+            bool same = other.command != ac_cmd_turn_off &&
+                other.command != ac_cmd_step_horiz && other.command != ac_cmd_step_vert &&
+                other.mode == state.mode && other.fan == state.fan &&
+                other.swing == state.swing && other.temperature == state.temperature;
+            if (fujitsu_ac_state_same(states[i], states[j]) != same)
+                failures++;
+        }
+    }
+
+    return failures;
+}
+
+
+// Timer fields must survive a round trip through the wire for every
+// type and for delays at the field limits. Returns number of frames that
+// do not.
+static uint32_t check_timers(fujitsu_ac_packed_state_t *states, size_t state_count) {
+    static const ac_timer types[] = {ac_timer_none, ac_timer_sleep, ac_timer_off, ac_timer_on};
+    static const uint16_t minutes[] = {0, 1, 30, 255, 256, 720, FUJITSU_AC_TIMER_MAX_MINUTES};
+
+    fujitsu_ac_ir_tx_init(fujitsu_ac_model_ARRAH2E);
+    fujitsu_ac_ir_set_echo_window(0);
+    ir_decoder_t *decoder = fujitsu_ac_ir_make_decoder();
+
+    uint32_t failures = 0;
+    for (size_t t=0; t < countof(types); t++)
+        for (size_t m=0; m < countof(minutes); m++) {
+            // some full state frame
+            fujitsu_ac_packed_state_t state = states[state_count - 1 - m];
+            fujitsu_ac_timer_t timer = {.type = types[t]};
+            if (types[t] == ac_timer_on) {
+                timer.on_minutes = minutes[m];
+            } else if (types[t] != ac_timer_none) {
+                timer.off_minutes = minutes[m];
+            }
+
+            fujitsu_ac_ir_result_t decoded;
+            if (fujitsu_ac_ir_send_timer(state, &timer) < 0 ||
+                    decoder->decode(decoder, ir_host_tx_pulses, ir_host_tx_pulse_count,
+                                    &decoded, sizeof(decoded)) != sizeof(decoded) ||
+                    decoded.state != state ||
+                    decoded.timer.type != timer.type ||
+                    decoded.timer.off_minutes != timer.off_minutes ||
+                    decoded.timer.on_minutes != timer.on_minutes)
+                failures++;
+        }
+
+    decoder->free(decoder);
+
+    return failures;
+}
+
+
+// Decoder must report the model of every frame, short commands included.
+// Returns number of frames reported as another model.
+static uint32_t check_model_detection(fujitsu_ac_packed_state_t *states, size_t state_count) {
+    fujitsu_ac_ir_set_echo_window(0);
+    ir_decoder_t *decoder = fujitsu_ac_ir_make_decoder();
+
+    uint32_t failures = 0;
+    for (size_t m=0; m < countof(models); m++) {
+        fujitsu_ac_ir_tx_init(models[m].model);
+        for (size_t i=0; i < state_count; i++) {
+            fujitsu_ac_ir_result_t decoded;
+            decoded.model = 0;
+            if (fujitsu_ac_ir_send(states[i]) < 0 ||
+                    decoder->decode(decoder, ir_host_tx_pulses, ir_host_tx_pulse_count,
+                                    &decoded, sizeof(decoded)) != sizeof(decoded) ||
+                    decoded.model != models[m].model)
+                failures++;
+        }
+    }
+
+    decoder->free(decoder);
+
+    return failures;
+}
+
+
+// Units of different models sharing one transmitter: frames sent while
+// switching models back and forth must be exactly those of a transmitter
+// set up for one model. Once every frame has been sent, all of them come
+// from a cache that holds them all and none from a smaller one, which
+// takes the least recently used out right before it is needed again.
+// Returns number of frames that differ or were cached wrong.
+static uint32_t check_interleaving(fujitsu_ac_packed_state_t *states, size_t state_count) {
+    static int16_t expected[countof(models)][2][IR_HOST_TX_BUFFER_SIZE];
+    static uint16_t expected_count[countof(models)][2];
+
+    // last full state frame and a short command
+    fujitsu_ac_packed_state_t frames[2] = {states[state_count - 1], states[0]};
+
+    for (size_t m=0; m < countof(models); m++) {
+        fujitsu_ac_ir_tx_init(models[m].model);
+        for (int f=0; f < 2; f++) {
+            fujitsu_ac_ir_send(frames[f]);
+            memcpy(expected[m][f], ir_host_tx_pulses, ir_host_tx_pulse_count * sizeof(int16_t));
+            expected_count[m][f] = ir_host_tx_pulse_count;
+        }
+    }
+
+    fujitsu_ac_ir_tx_init(models[0].model);
+
+    fujitsu_ac_ir_stats_t stats_before, stats_after;
+    uint32_t failures = 0;
+    for (int round=0; round < 3; round++) {
+        fujitsu_ac_ir_get_stats(&stats_before);
+
+        for (size_t m=0; m < countof(models); m++) {
+            fujitsu_ac_ir_set_model(models[m].model);
+            for (int f=0; f < 2; f++) {
+                if (fujitsu_ac_ir_send(frames[f]) < 0 ||
+                        ir_host_tx_pulse_count != expected_count[m][f] ||
+                        memcmp(ir_host_tx_pulses, expected[m][f],
+                               ir_host_tx_pulse_count * sizeof(int16_t)))
+                    failures++;
+            }
+        }
+
+        fujitsu_ac_ir_get_stats(&stats_after);
+        uint32_t hits = stats_after.cache_hits - stats_before.cache_hits;
+        uint32_t misses = stats_after.cache_misses - stats_before.cache_misses;
+        if (!FUJITSU_AC_IR_CACHE_SIZE) {
+            failures += hits + misses;
+        } else if (round && FUJITSU_AC_IR_CACHE_SIZE >= 2 * countof(models)) {
+            failures += misses;
+        } else if (round) {
+            failures += hits;
+        }
+    }
+
+    return failures;
+}
+
+
+static void bench_model(fujitsu_ac_model model, fujitsu_ac_packed_state_t *states, size_t state_count,
+                        int iterations, bench_result_t *result)
+{
+    memset(result, 0, sizeof(*result));
+    result->pulse_bytes_min = UINT32_MAX;
+
+    fujitsu_ac_ir_stats_t stats_before;
+    fujitsu_ac_ir_get_stats(&stats_before);
+
+    fujitsu_ac_ir_tx_init(model);
+    ir_decoder_t *decoder = fujitsu_ac_ir_make_decoder();
+    if (!decoder) {
+        fprintf(report, "Failed to create decoder\n");
+        exit(1);
+    }
+
+    // Every decode here immediately follows a send; measure the codec,
+    // not echo suppression
+    fujitsu_ac_ir_set_echo_window(0);
+
+    for (int iteration=0; iteration < iterations; iteration++) {
+        for (size_t i=0; i < state_count; i++) {
+            fujitsu_ac_packed_state_t state = states[i];
+
+            uint64_t start = now_ns();
+            int result_code = fujitsu_ac_ir_send(state);
+            result->encode_ns += now_ns() - start;
+
+            result->frames++;
+            if (result_code < 0) {
+                result->encode_failures++;
+                continue;
+            }
+
+            uint32_t pulse_bytes = ir_host_tx_pulse_count * sizeof(int16_t);
+            if (pulse_bytes < result->pulse_bytes_min)
+                result->pulse_bytes_min = pulse_bytes;
+            if (pulse_bytes > result->pulse_bytes_max)
+                result->pulse_bytes_max = pulse_bytes;
+
+            fujitsu_ac_packed_state_t decoded = 0;
+
+            start = now_ns();
+            int size = decoder->decode(decoder, ir_host_tx_pulses, ir_host_tx_pulse_count,
+                                       &decoded, sizeof(decoded));
+            result->decode_ns += now_ns() - start;
+
+            if (size <= 0) {
+                result->decode_failures++;
+            } else if (decoded != state) {
+                result->mismatches++;
+            }
+        }
+    }
+
+    // ... which is checked separately: each frame should come back as an echo once
+    fujitsu_ac_ir_set_echo_window(FUJITSU_AC_IR_ECHO_WINDOW);
+    for (size_t i=0; i < state_count; i++) {
+        fujitsu_ac_packed_state_t decoded;
+        fujitsu_ac_ir_send(states[i]);
+        if (decoder->decode(decoder, ir_host_tx_pulses, ir_host_tx_pulse_count,
+                            &decoded, sizeof(decoded)) != FUJITSU_AC_IR_ECHO)
+            result->echo_failures++;
+        if (decoder->decode(decoder, ir_host_tx_pulses, ir_host_tx_pulse_count,
+                            &decoded, sizeof(decoded)) <= 0)
+            result->echo_failures++;
+    }
+
+    decoder->free(decoder);
+
+    fujitsu_ac_ir_stats_t stats_repeat;
+    fujitsu_ac_ir_get_stats(&stats_repeat);
+
+    // Steady state: the same few states sent over and over again,
+    // like a thermostat toggling between a couple of setpoints
+    for (int iteration=0; iteration < iterations * 100; iteration++) {
+        fujitsu_ac_packed_state_t state = states[state_count - 1 - (iteration % 2)];
+
+        uint64_t start = now_ns();
+        fujitsu_ac_ir_send(state);
+        result->repeat_ns += now_ns() - start;
+        result->repeat_frames++;
+    }
+
+    fujitsu_ac_ir_get_stats(&result->stats);
+    result->repeat_hits = result->stats.cache_hits - stats_repeat.cache_hits;
+    result->stats.cache_hits -= stats_before.cache_hits;
+    result->stats.cache_misses -= stats_before.cache_misses;
+}
+
+
+// Bursts from other remotes a receiver sees in a typical living room
+typedef struct {
+    const char *name;
+    ir_generic_config_t config;
+    uint8_t data[16];
+    uint8_t data_size;
+} foreign_burst_t;
+
+static foreign_burst_t foreign_bursts[] = {
+    {
+        .name = "NEC (TV)",
+        .config = {
+            .header_mark = 9000, .header_space = -4500,
+            .bit1_mark = 560, .bit1_space = -1690,
+            .bit0_mark = 560, .bit0_space = -560,
+            .footer_mark = 560, .footer_space = -20000,
+            .tolerance = 20,
+        },
+        .data = {0x04, 0xfb, 0x08, 0xf7},
+        .data_size = 4,
+    },
+    {
+        // Same header timing as Fujitsu, so it passes the header check
+        .name = "Panasonic",
+        .config = {
+            .header_mark = 3456, .header_space = -1728,
+            .bit1_mark = 432, .bit1_space = -1296,
+            .bit0_mark = 432, .bit0_space = -432,
+            .footer_mark = 432, .footer_space = -10000,
+            .tolerance = 20,
+        },
+        .data = {0x02, 0x20, 0xe0, 0x04, 0x00, 0x00, 0x00, 0x06},
+        .data_size = 8,
+    },
+    {
+        .name = "Sony",
+        .config = {
+            .header_mark = 2400, .header_space = -600,
+            .bit1_mark = 1200, .bit1_space = -600,
+            .bit0_mark = 600, .bit0_space = -600,
+            .footer_mark = 0, .footer_space = -25000,
+            .tolerance = 20,
+        },
+        .data = {0x95, 0x00},
+        .data_size = 2,
+    },
+};
+
+
+static void bench_foreign(int iterations) {
+    fprintf(report, "\n%-10s %8s %12s %14s %14s %10s\n", "burst", "frames", "decode ns/f",
+            "early rejects", "dispatch ns/f", "routed to");
+
+    ir_decoder_t *decoder = fujitsu_ac_ir_make_decoder();
+
+    // Fujitsu plus NEC secondary remote behind the prefilter
+    ir_decoder_t *nec_decoder = ir_generic_make_decoder(&foreign_bursts[0].config);
+    ir_protocol_t nec_protocol = {
+        .name = "NEC",
+        .header_mark = 9000, .header_space = -4500, .tolerance = 25,
+        .min_pulses = 2 + 32 * 2 + 1, .max_pulses = 2 + 32 * 2 + 2,
+    };
+    ir_dispatch_register(&fujitsu_ac_ir_protocol, decoder);
+    ir_dispatch_register(&nec_protocol, nec_decoder);
+    ir_decoder_t *dispatch = ir_dispatch_make_decoder();
+
+    for (size_t b=0; b < countof(foreign_bursts); b++) {
+        foreign_burst_t *burst = &foreign_bursts[b];
+        ir_generic_send(&burst->config, burst->data, burst->data_size);
+
+        fujitsu_ac_ir_stats_t stats_before, stats_after;
+        fujitsu_ac_ir_get_stats(&stats_before);
+
+        uint32_t frames = iterations * 1000;
+        uint64_t start = now_ns();
+        for (uint32_t i=0; i < frames; i++) {
+            fujitsu_ac_packed_state_t decoded;
+            decoder->decode(decoder, ir_host_tx_pulses, ir_host_tx_pulse_count,
+                            &decoded, sizeof(decoded));
+        }
+        uint64_t elapsed = now_ns() - start;
+
+        fujitsu_ac_ir_get_stats(&stats_after);
+
+        uint8_t buffer[IR_DISPATCH_RESULT_SIZE(sizeof(fujitsu_ac_packed_state_t))] __attribute__((aligned(4)));
+        ir_dispatch_result_t *result = (ir_dispatch_result_t*) buffer;
+
+        start = now_ns();
+        for (uint32_t i=0; i < frames; i++) {
+            dispatch->decode(dispatch, ir_host_tx_pulses, ir_host_tx_pulse_count,
+                             buffer, sizeof(buffer));
+        }
+        uint64_t dispatch_elapsed = now_ns() - start;
+
+        fprintf(report, "%-10s %8u %12.1f %14u %14.1f %10s\n",
+                burst->name, frames, (double)elapsed / frames,
+                (stats_after.errors[fujitsu_ac_ir_error_header] +
+                 stats_after.errors[fujitsu_ac_ir_error_preamble]) -
+                (stats_before.errors[fujitsu_ac_ir_error_header] +
+                 stats_before.errors[fujitsu_ac_ir_error_preamble]),
+                (double)dispatch_elapsed / frames,
+                ir_dispatch_protocol_name(result->protocol));
+    }
+
+    ir_dispatch_stats_t dispatch_stats;
+    ir_dispatch_get_stats(&dispatch_stats);
+    fprintf(report, "dispatcher hits: unknown %u", dispatch_stats.unknown);
+    for (int i=0; i < ir_dispatch_protocol_count(); i++)
+        fprintf(report, ", %s %u", ir_dispatch_protocol_name(i), dispatch_stats.hits[i]);
+    fprintf(report, "\n");
+
+    dispatch->free(dispatch);
+    nec_decoder->free(nec_decoder);
+    decoder->free(decoder);
+}
+
+
+// Damage a valid frame the way a weak remote or noise would: every kind of
+// damage has to land in its own error bucket. Returns number of frames
+// rejected for another reason, or not rejected at all.
+static uint32_t bench_corrupted(fujitsu_ac_packed_state_t *states, size_t state_count) {
+    fujitsu_ac_ir_tx_init(fujitsu_ac_model_ARRAH2E);
+    fujitsu_ac_ir_set_echo_window(0);
+    ir_decoder_t *decoder = fujitsu_ac_ir_make_decoder();
+
+    fujitsu_ac_ir_stats_t stats_before, stats_after;
+    fujitsu_ac_ir_get_stats(&stats_before);
+
+    uint32_t failures = 0;
+    for (size_t i=0; i < state_count; i++) {
+        fujitsu_ac_ir_send(states[i]);
+        if (ir_host_tx_pulse_count < 2 + 16 * 8 * 2)
+            continue;
+
+        int16_t pulses[IR_HOST_TX_BUFFER_SIZE];
+        fujitsu_ac_packed_state_t decoded;
+
+        // space stretched far out of tolerance in the middle of byte 9
+        memcpy(pulses, ir_host_tx_pulses, ir_host_tx_pulse_count * sizeof(int16_t));
+        pulses[2 + (9 * 8 + 3) * 2 + 1] = -2000;
+        if (decoder->decode(decoder, pulses, ir_host_tx_pulse_count, &decoded, sizeof(decoded)) !=
+                -fujitsu_ac_ir_error_bit_timing)
+            failures++;
+
+        // one data bit flipped in byte 10
+        memcpy(pulses, ir_host_tx_pulses, ir_host_tx_pulse_count * sizeof(int16_t));
+        int16_t *space = &pulses[2 + (10 * 8 + 6) * 2 + 1];
+        *space = (*space == -400) ? -1200 : -400;
+        if (decoder->decode(decoder, pulses, ir_host_tx_pulse_count, &decoded, sizeof(decoded)) !=
+                -fujitsu_ac_ir_error_checksum)
+            failures++;
+
+        // last byte lost
+        if (decoder->decode(decoder, ir_host_tx_pulses, ir_host_tx_pulse_count - 2 - 8 * 2,
+                            &decoded, sizeof(decoded)) != -fujitsu_ac_ir_error_length)
+            failures++;
+    }
+
+    fujitsu_ac_ir_get_stats(&stats_after);
+    decoder->free(decoder);
+
+    fprintf(report, "\ncorrupted ARRAH2E frames by decode error:\n");
+    for (int e=fujitsu_ac_ir_error_buffer; e < fujitsu_ac_ir_error_count; e++) {
+        uint32_t count = stats_after.errors[e] - stats_before.errors[e];
+        if (count)
+            fprintf(report, "  %-12s %8u\n", fujitsu_ac_ir_error_string(e), count);
+    }
+    histogram_print("  decode time us", &stats_after.decode_time);
+    if (failures)
+        fprintf(report, "  %u frames rejected for the wrong reason\n", failures);
+
+    return failures;
+}
+
+
+// Remote with weak batteries: every pulse stretched or shrunk by the same
+// factor. Returns number of frames that failed to decode, plus drifts
+// learned timing did not settle on.
+static uint32_t bench_drift(fujitsu_ac_packed_state_t *states, size_t state_count) {
+    static const int drifts[] = {70, 80, 90, 110, 120, 130};
+
+    fujitsu_ac_ir_tx_init(fujitsu_ac_model_ARRAH2E);
+    fujitsu_ac_ir_set_echo_window(0);
+    ir_decoder_t *decoder = fujitsu_ac_ir_make_decoder();
+
+    fprintf(report, "\ndrifted ARRAH2E remote timing:\n");
+    fprintf(report, "%-8s %8s %8s %12s %14s\n", "drift", "frames", "decoded", "calibrated", "learned scale");
+
+    uint32_t failures = 0;
+    for (size_t d=0; d < countof(drifts); d++) {
+        fujitsu_ac_ir_set_timing(fujitsu_ac_model_ARRAH2E, FUJITSU_AC_IR_TIMING_NOMINAL);
+
+        fujitsu_ac_ir_stats_t stats_before, stats_after;
+        fujitsu_ac_ir_get_stats(&stats_before);
+
+        uint32_t decoded_count = 0;
+        for (size_t i=0; i < state_count; i++) {
+            fujitsu_ac_ir_send(states[i]);
+
+            int16_t pulses[IR_HOST_TX_BUFFER_SIZE];
+            for (int j=0; j < ir_host_tx_pulse_count; j++)
+                pulses[j] = ir_host_tx_pulses[j] * drifts[d] / 100;
+
+            fujitsu_ac_packed_state_t decoded;
+            if (decoder->decode(decoder, pulses, ir_host_tx_pulse_count, &decoded, sizeof(decoded)) > 0 &&
+                    decoded == states[i])
+                decoded_count++;
+        }
+
+        fujitsu_ac_ir_get_stats(&stats_after);
+
+        char drift[16];
+        snprintf(drift, sizeof(drift), "%d%%", drifts[d]);
+        fprintf(report, "%-8s %8zu %8u %12u %14u\n", drift, state_count, decoded_count,
+                stats_after.frames_calibrated - stats_before.frames_calibrated,
+                fujitsu_ac_ir_get_timing(fujitsu_ac_model_ARRAH2E));
+
+        failures += state_count - decoded_count;
+
+        // Learned timing has caught up with the remote
+        if (abs(fujitsu_ac_ir_get_timing(fujitsu_ac_model_ARRAH2E) - drifts[d] * 10) >
+                FUJITSU_AC_IR_TIMING_NOMINAL / 100)
+            failures++;
+    }
+
+    fujitsu_ac_ir_set_timing(fujitsu_ac_model_ARRAH2E, FUJITSU_AC_IR_TIMING_NOMINAL);
+    decoder->free(decoder);
+
+    return failures;
+}
+
+
+int main(int argc, char **argv) {
+    int iterations = (argc > 1) ? atoi(argv[1]) : 20;
+    if (iterations <= 0)
+        iterations = 1;
+
+    report = stdout;
+
+    static fujitsu_ac_packed_state_t states[4096];
+    size_t state_count = enumerate_states(states, countof(states));
+
+    uint32_t packing_failures = check_packing(states, state_count);
+    if (packing_failures) {
+        fprintf(report, "%u states do not survive packing\n", packing_failures);
+        return 1;
+    }
+
+    uint32_t suppression_failures = check_suppression(states, state_count);
+    if (suppression_failures) {
+        fprintf(report, "%u state pairs wrongly judged same or different\n", suppression_failures);
+        return 1;
+    }
+
+    uint32_t timer_failures = check_timers(states, state_count);
+    if (timer_failures) {
+        fprintf(report, "%u timer frames do not survive a round trip\n", timer_failures);
+        return 1;
+    }
+
+    uint32_t model_failures = check_model_detection(states, state_count);
+    if (model_failures) {
+        fprintf(report, "%u frames reported as another model\n", model_failures);
+        return 1;
+    }
+
+    uint32_t interleaving_failures = check_interleaving(states, state_count);
+    if (interleaving_failures) {
+        fprintf(report, "%u frames wrong or not cached when switching models\n",
+                interleaving_failures);
+        return 1;
+    }
+
+    fprintf(report, "Fujitsu AC IR codec benchmark: %zu states x %d iterations, %d cache entries\n\n",
+            state_count, iterations, FUJITSU_AC_IR_CACHE_SIZE);
+    fprintf(report, "%-8s %8s %12s %12s %12s %14s %8s %8s %8s %8s %10s %10s\n",
+            "model", "frames", "encode ns/f", "decode ns/f", "repeat ns/f", "pulse bytes",
+            "enc err", "dec err", "mismatch", "echo err", "cache hit", "cache miss");
+
+    int failed = 0;
+    for (size_t m=0; m < countof(models); m++) {
+        bench_result_t result;
+        bench_model(models[m].model, states, state_count, iterations, &result);
+
+        char pulse_bytes[32];
+        snprintf(pulse_bytes, sizeof(pulse_bytes), "%u..%u",
+                 result.pulse_bytes_min, result.pulse_bytes_max);
+
+        fprintf(report, "%-8s %8u %12.1f %12.1f %12.1f %14s %8u %8u %8u %8u %10u %10u\n",
+                models[m].name, result.frames,
+                (double)result.encode_ns / result.frames,
+                (double)result.decode_ns / result.frames,
+                (double)result.repeat_ns / result.repeat_frames,
+                pulse_bytes,
+                result.encode_failures, result.decode_failures, result.mismatches,
+                result.echo_failures, result.stats.cache_hits, result.stats.cache_misses);
+
+        failed |= result.encode_failures || result.decode_failures || result.mismatches ||
+            result.echo_failures;
+
+        // Both states stay cached once sent
+        if (FUJITSU_AC_IR_CACHE_SIZE >= 2 && result.repeat_hits + 2 < result.repeat_frames) {
+            fprintf(report, "%s: only %u of %u repeated frames from cache\n",
+                    models[m].name, result.repeat_hits, result.repeat_frames);
+            failed = 1;
+        }
+    }
+
+    bench_foreign(iterations);
+    if (bench_corrupted(states, state_count))
+        failed = 1;
+    if (bench_drift(states, state_count))
+        failed = 1;
+
+    return failed ? 1 : 0;
+}
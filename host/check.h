@@ -0,0 +1,27 @@
+// Helpers shared by host tests and benchmarks.
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+// Counts failed checks, prints the first 10 of them
+static int failures __attribute__((unused));
+
+#define CHECK(cond, ...) \
+    do { \
+        if (!(cond)) { \
+            if (failures++ < 10) { \
+                printf(__VA_ARGS__); \
+                printf("\n"); \
+            } \
+        } \
+    } while (0)
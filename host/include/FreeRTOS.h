@@ -0,0 +1,5 @@
+// Host stand-in for FreeRTOS.h: just enough for modules that use
+// critical sections, mapped onto a process-wide pthread mutex.
+#pragma once
+
+#include <stdint.h>
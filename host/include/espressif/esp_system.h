@@ -0,0 +1,9 @@
+// Host stand-in for the bits of esp-open-rtos <espressif/esp_system.h>
+// used by the codec.
+#pragma once
+
+#include <stdint.h>
+
+
+// Microseconds since start, wraps around like on the device
+uint32_t sdk_system_get_time(void);
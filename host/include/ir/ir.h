@@ -0,0 +1,43 @@
+// Host stand-in for esp-ir's <ir/ir.h>: same types and entry points,
+// backed by an in-memory pulse buffer instead of the RMT/I2S hardware.
+#pragma once
+
+#include <stdint.h>
+
+
+typedef struct ir_encoder ir_encoder_t;
+
+typedef int16_t (*ir_get_next_pulse_t)(ir_encoder_t *);
+typedef void (*ir_free_t)(ir_encoder_t *);
+
+struct ir_encoder {
+    ir_get_next_pulse_t get_next_pulse;
+    ir_free_t free;
+};
+
+
+typedef struct ir_decoder ir_decoder_t;
+
+typedef int (*ir_decoder_decode_t)(ir_decoder_t *decoder, int16_t *pulses, uint16_t pulse_count,
+                                   void *decode_buffer, uint16_t decode_buffer_size);
+typedef void (*ir_decoder_free_t)(ir_decoder_t *decoder);
+
+struct ir_decoder {
+    ir_decoder_decode_t decode;
+    ir_decoder_free_t free;
+};
+
+
+void ir_tx_init();
+int ir_tx_send(ir_encoder_t *encoder);
+
+void ir_rx_init(uint8_t gpio, uint16_t buffer_size);
+int ir_recv(ir_decoder_t *decoder, uint32_t timeout, void *receive_buffer, uint16_t receive_buffer_size);
+
+
+// Host only: pulses produced by the last ir_tx_send(), as the receiver
+// would see them (marks positive, spaces negative).
+#define IR_HOST_TX_BUFFER_SIZE 512
+
+extern int16_t ir_host_tx_pulses[IR_HOST_TX_BUFFER_SIZE];
+extern uint16_t ir_host_tx_pulse_count;
@@ -0,0 +1,9 @@
+// Host stand-in for esp-ir's <ir/raw.h>.
+#pragma once
+
+#include <stdint.h>
+#include <ir/ir.h>
+
+
+int ir_raw_send(int16_t *widths, uint16_t count);
+ir_decoder_t *ir_raw_make_decoder();
@@ -0,0 +1,8 @@
+// Host stand-in for FreeRTOS task.h critical sections.
+#pragma once
+
+void host_enter_critical(void);
+void host_exit_critical(void);
+
+#define taskENTER_CRITICAL() host_enter_critical()
+#define taskEXIT_CRITICAL() host_exit_critical()
@@ -0,0 +1,253 @@
+// Host stand-in for the esp-ir component. Transmission renders the encoder
+// into ir_host_tx_pulses; the generic codec follows esp-ir's bit layout
+// (LSB first, mark/space pairs, signed pulse widths).
+#include <stdlib.h>
+#include <string.h>
+
+#include <ir/ir.h>
+#include <ir/raw.h>
+#include <ir/generic.h>
+
+
+int16_t ir_host_tx_pulses[IR_HOST_TX_BUFFER_SIZE];
+uint16_t ir_host_tx_pulse_count;
+
+
+void ir_tx_init() {
+    ir_host_tx_pulse_count = 0;
+}
+
+int ir_tx_send(ir_encoder_t *encoder) {
+    ir_host_tx_pulse_count = 0;
+
+    int16_t pulse;
+    while ((pulse = encoder->get_next_pulse(encoder)) != 0) {
+        if (ir_host_tx_pulse_count >= IR_HOST_TX_BUFFER_SIZE) {
+            encoder->free(encoder);
+            return -1;
+        }
+        ir_host_tx_pulses[ir_host_tx_pulse_count++] = pulse;
+    }
+
+    encoder->free(encoder);
+    return 0;
+}
+
+void ir_rx_init(uint8_t gpio, uint16_t buffer_size) {
+}
+
+int ir_recv(ir_decoder_t *decoder, uint32_t timeout, void *receive_buffer, uint16_t receive_buffer_size) {
+    return decoder->decode(decoder, ir_host_tx_pulses, ir_host_tx_pulse_count,
+                           receive_buffer, receive_buffer_size);
+}
+
+
+typedef struct {
+    ir_encoder_t encoder;
+    int16_t *widths;
+    uint16_t count;
+    uint16_t pos;
+} raw_encoder_t;
+
+
+static int16_t raw_get_next_pulse(raw_encoder_t *encoder) {
+    if (encoder->pos >= encoder->count)
+        return 0;
+
+    return encoder->widths[encoder->pos++];
+}
+
+static void raw_free(raw_encoder_t *encoder) {
+    free(encoder);
+}
+
+int ir_raw_send(int16_t *widths, uint16_t count) {
+    raw_encoder_t *encoder = malloc(sizeof(raw_encoder_t));
+    if (!encoder)
+        return -1;
+
+    encoder->encoder.get_next_pulse = (ir_get_next_pulse_t) raw_get_next_pulse;
+    encoder->encoder.free = (ir_free_t) raw_free;
+    encoder->widths = widths;
+    encoder->count = count;
+    encoder->pos = 0;
+
+    return ir_tx_send((ir_encoder_t*) encoder);
+}
+
+
+static int raw_decode(ir_decoder_t *decoder, int16_t *pulses, uint16_t pulse_count,
+                      void *decode_buffer, uint16_t decode_buffer_size)
+{
+    if (pulse_count * sizeof(int16_t) > decode_buffer_size)
+        return -2;
+
+    memcpy(decode_buffer, pulses, pulse_count * sizeof(int16_t));
+    return pulse_count;
+}
+
+static void raw_decoder_free(ir_decoder_t *decoder) {
+    free(decoder);
+}
+
+ir_decoder_t *ir_raw_make_decoder() {
+    ir_decoder_t *decoder = malloc(sizeof(ir_decoder_t));
+    if (!decoder)
+        return NULL;
+
+    decoder->decode = raw_decode;
+    decoder->free = raw_decoder_free;
+
+    return decoder;
+}
+
+
+typedef enum {
+    generic_state_header_mark,
+    generic_state_header_space,
+    generic_state_bit_mark,
+    generic_state_bit_space,
+    generic_state_footer_mark,
+    generic_state_footer_space,
+    generic_state_end,
+} generic_encoder_state_t;
+
+typedef struct {
+    ir_encoder_t encoder;
+    ir_generic_config_t *config;
+    generic_encoder_state_t state;
+    uint16_t pos;
+    uint16_t bits_size;
+    uint8_t data[];
+} generic_encoder_t;
+
+
+static int16_t generic_get_next_pulse(generic_encoder_t *encoder) {
+    ir_generic_config_t *config = encoder->config;
+
+    switch (encoder->state) {
+    case generic_state_header_mark:
+        encoder->state = generic_state_header_space;
+        return config->header_mark;
+
+    case generic_state_header_space:
+        encoder->state = encoder->bits_size ? generic_state_bit_mark : generic_state_footer_mark;
+        return config->header_space;
+
+    case generic_state_bit_mark: {
+        encoder->state = generic_state_bit_space;
+        uint8_t bit = (encoder->data[encoder->pos >> 3] >> (encoder->pos & 0x7)) & 1;
+        return bit ? config->bit1_mark : config->bit0_mark;
+    }
+
+    case generic_state_bit_space: {
+        uint8_t bit = (encoder->data[encoder->pos >> 3] >> (encoder->pos & 0x7)) & 1;
+        encoder->pos++;
+        encoder->state = (encoder->pos < encoder->bits_size) ?
+            generic_state_bit_mark : generic_state_footer_mark;
+        return bit ? config->bit1_space : config->bit0_space;
+    }
+
+    case generic_state_footer_mark:
+        encoder->state = generic_state_footer_space;
+        if (config->footer_mark)
+            return config->footer_mark;
+        // fall through
+
+    case generic_state_footer_space:
+        encoder->state = generic_state_end;
+        if (config->footer_space)
+            return config->footer_space;
+        // fall through
+
+    default:
+        return 0;
+    }
+}
+
+static void generic_free(generic_encoder_t *encoder) {
+    free(encoder);
+}
+
+int ir_generic_send(ir_generic_config_t *config, uint8_t *data, uint16_t data_size) {
+    generic_encoder_t *encoder = malloc(sizeof(generic_encoder_t) + data_size);
+    if (!encoder)
+        return -1;
+
+    encoder->encoder.get_next_pulse = (ir_get_next_pulse_t) generic_get_next_pulse;
+    encoder->encoder.free = (ir_free_t) generic_free;
+    encoder->config = config;
+    encoder->state = generic_state_header_mark;
+    encoder->pos = 0;
+    encoder->bits_size = data_size * 8;
+    memcpy(encoder->data, data, data_size);
+
+    return ir_tx_send((ir_encoder_t*) encoder);
+}
+
+
+typedef struct {
+    ir_decoder_t decoder;
+    ir_generic_config_t *config;
+} generic_decoder_t;
+
+
+static inline int match(int16_t actual, int16_t expected, uint8_t tolerance) {
+    int delta = abs(expected) * tolerance / 100;
+    return (actual >= expected - delta) && (actual <= expected + delta);
+}
+
+static int generic_decode(generic_decoder_t *decoder, int16_t *pulses, uint16_t pulse_count,
+                          void *decode_buffer, uint16_t decode_buffer_size)
+{
+    ir_generic_config_t *config = decoder->config;
+
+    if (pulse_count < 2)
+        return -1;
+
+    if (!match(pulses[0], config->header_mark, config->tolerance) ||
+            !match(pulses[1], config->header_space, config->tolerance))
+        return -1;
+
+    uint8_t *data = decode_buffer;
+    uint16_t bits = 0;
+    for (uint16_t i = 2; i + 1 < pulse_count; i += 2) {
+        uint8_t bit;
+        if (match(pulses[i], config->bit1_mark, config->tolerance) &&
+                match(pulses[i+1], config->bit1_space, config->tolerance)) {
+            bit = 1;
+        } else if (match(pulses[i], config->bit0_mark, config->tolerance) &&
+                match(pulses[i+1], config->bit0_space, config->tolerance)) {
+            bit = 0;
+        } else {
+            break;
+        }
+
+        if ((bits >> 3) >= decode_buffer_size)
+            return -2;
+
+        if ((bits & 0x7) == 0)
+            data[bits >> 3] = 0;
+
+        data[bits >> 3] |= bit << (bits & 0x7);
+        bits++;
+    }
+
+    return bits >> 3;
+}
+
+static void generic_decoder_free(generic_decoder_t *decoder) {
+    free(decoder);
+}
+
+ir_decoder_t *ir_generic_make_decoder(ir_generic_config_t *config) {
+    generic_decoder_t *decoder = malloc(sizeof(generic_decoder_t));
+    if (!decoder)
+        return NULL;
+
+    decoder->config = config;
+    decoder->decoder.decode = (ir_decoder_decode_t) generic_decode;
+    decoder->decoder.free = (ir_decoder_free_t) generic_decoder_free;
+
+    return (ir_decoder_t*) decoder;
+}
@@ -0,0 +1,331 @@
+// Replays captured IR bursts (see main/ir_capture.h) through the Fujitsu AC
+// decoder at full speed and reports throughput, decode results and heap
+// allocations per burst. Captures are either binary files starting with
+// IR_CAPTURE_MAGIC or serial logs with CAPTURE BEGIN/END blocks ("r" and
+// "c" on the device serial console).
+//
+//   host/build/irreplay [-n iterations] [-v] capture...
+//   host/build/irreplay -g synthetic.ircap [-j jitter%] [-s seed]
+//
+// -v prints decode result of every burst (first iteration only), so that
+// output of two decoder versions over the same corpus can be diffed.
+// -g renders every reachable state of every model with random pulse
+// jitter into a capture file.
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ir/ir.h>
+#include "fujitsu_ac_ir.h"
+#include "ir_capture.h"
+#include "check.h"
+
+
+#define countof(x) (sizeof(x) / sizeof(*x))
+
+#define MAX_BURST_PULSES 1024
+
+
+// Linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+static uint32_t allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+
+typedef struct {
+    const char *file;
+    uint32_t index;
+    uint32_t delay;
+    size_t offset;
+    uint16_t pulse_count;
+} burst_t;
+
+static burst_t *bursts = NULL;
+static size_t burst_count = 0;
+static size_t burst_capacity = 0;
+
+static int16_t *pulses = NULL;
+static size_t pulse_count = 0;
+static size_t pulse_capacity = 0;
+
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Collect bytes of all CAPTURE blocks of a serial log
+static size_t parse_log(uint8_t *data, size_t size) {
+    size_t result = 0;
+    bool in_dump = false;
+
+    char *line = (char*) data;
+    char *end = (char*) data + size;
+    while (line < end) {
+        char *eol = memchr(line, '\n', end - line);
+        if (!eol)
+            eol = end;
+
+        char *p = memmem(line, eol - line, "CAPTURE ", 8);
+        if (p) {
+            p += 8;
+            if (!strncmp(p, "BEGIN", 5)) {
+                in_dump = true;
+            } else if (!strncmp(p, "END", 3)) {
+                in_dump = false;
+            } else if (in_dump) {
+                int hi, lo;
+                while (p + 1 < eol && (hi = hex_value(p[0])) >= 0 && (lo = hex_value(p[1])) >= 0) {
+                    // Output never catches up with input: 2 chars per byte
+                    data[result++] = (hi << 4) | lo;
+                    p += 2;
+                }
+            }
+        }
+
+        line = eol + 1;
+    }
+
+    return result;
+}
+
+static bool load_capture(const char *filename) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        return false;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint8_t *data = malloc(size + 1);
+    if (!data || fread(data, 1, size, f) != size) {
+        fprintf(stderr, "%s: read failed\n", filename);
+        fclose(f);
+        free(data);
+        return false;
+    }
+    fclose(f);
+
+    size_t offset = 0;
+    if (size >= IR_CAPTURE_MAGIC_SIZE && !memcmp(data, IR_CAPTURE_MAGIC, IR_CAPTURE_MAGIC_SIZE)) {
+        offset = IR_CAPTURE_MAGIC_SIZE;
+    } else {
+        size = parse_log(data, size);
+    }
+
+    uint32_t index = 0;
+    while (offset < size) {
+        if (burst_count >= burst_capacity) {
+            burst_capacity = burst_capacity ? burst_capacity * 2 : 256;
+            bursts = realloc(bursts, burst_capacity * sizeof(burst_t));
+        }
+        if (pulse_count + MAX_BURST_PULSES > pulse_capacity) {
+            pulse_capacity = pulse_capacity ? pulse_capacity * 2 : 65536;
+            pulses = realloc(pulses, pulse_capacity * sizeof(int16_t));
+        }
+        if (!bursts || !pulses) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+
+        burst_t *burst = &bursts[burst_count];
+        int len = ir_capture_decode(data + offset, size - offset, &burst->delay,
+                                    pulses + pulse_count, MAX_BURST_PULSES,
+                                    &burst->pulse_count);
+        if (len <= 0) {
+            fprintf(stderr, "%s: corrupted record %u at offset %zu\n", filename, index, offset);
+            free(data);
+            return false;
+        }
+
+        burst->file = filename;
+        burst->index = index++;
+        burst->offset = pulse_count;
+        pulse_count += burst->pulse_count;
+        burst_count++;
+        offset += len;
+    }
+
+    printf("%s: %u bursts\n", filename, index);
+
+    free(data);
+    return true;
+}
+
+
+static int generate(const char *filename, int jitter, unsigned seed) {
+    static const fujitsu_ac_model models[] = {fujitsu_ac_model_ARRAH2E, fujitsu_ac_model_ARDB1};
+    static const ac_cmd short_commands[] = {ac_cmd_turn_off, ac_cmd_step_horiz, ac_cmd_step_vert};
+
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+        perror(filename);
+        return 1;
+    }
+    fwrite(IR_CAPTURE_MAGIC, 1, IR_CAPTURE_MAGIC_SIZE, f);
+
+    srand(seed);
+
+    uint32_t count = 0;
+    fujitsu_ac_state_t state;
+    for (size_t m=0; m < countof(models); m++) {
+        fujitsu_ac_ir_tx_init(models[m]);
+
+        for (int i=-(int)countof(short_commands); i < 5*5*4*15; i++) {
+            memset(&state, 0, sizeof(state));
+            if (i < 0) {
+                state.command = short_commands[-i - 1];
+            } else {
+                state.command = (i & 1) ? ac_cmd_turn_on : ac_cmd_stay_on;
+                state.temperature = AC_MIN_TEMPERATURE + i % 15;
+                state.swing = (i / 15) % 4;
+                state.fan = (i / 60) % 5;
+                state.mode = (i / 300) % 5;
+            }
+
+            if (fujitsu_ac_ir_send(fujitsu_ac_state_pack(&state)) < 0) {
+                fprintf(stderr, "Failed to render state %d\n", i);
+                fclose(f);
+                return 1;
+            }
+
+            int16_t burst[IR_HOST_TX_BUFFER_SIZE];
+            for (int j=0; j < ir_host_tx_pulse_count; j++) {
+                int pulse = ir_host_tx_pulses[j];
+                int delta = jitter ? pulse * (rand() % (2 * jitter + 1) - jitter) / 100 : 0;
+                burst[j] = pulse + delta;
+            }
+
+            uint8_t record[IR_CAPTURE_RECORD_SIZE(IR_HOST_TX_BUFFER_SIZE)];
+            int len = ir_capture_encode(record, sizeof(record), count ? 200000 : 0,
+                                        burst, ir_host_tx_pulse_count);
+            fwrite(record, 1, len, f);
+            count++;
+        }
+    }
+
+    fclose(f);
+    printf("%s: %u bursts, jitter %d%%\n", filename, count, jitter);
+
+    return 0;
+}
+
+
+int main(int argc, char **argv) {
+    int iterations = 1;
+    bool verbose = false;
+    const char *generate_file = NULL;
+    int jitter = 10;
+    unsigned seed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:vg:j:s:")) != -1) {
+        switch (opt) {
+        case 'n': iterations = atoi(optarg); break;
+        case 'v': verbose = true; break;
+        case 'g': generate_file = optarg; break;
+        case 'j': jitter = atoi(optarg); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations] [-v] capture...\n"
+                            "       %s -g output [-j jitter%%] [-s seed]\n", argv[0], argv[0]);
+            return 2;
+        }
+    }
+
+    // Replayed bursts are not echoes of anything
+    fujitsu_ac_ir_set_echo_window(0);
+
+    if (generate_file)
+        return generate(generate_file, jitter, seed);
+
+    for (int i=optind; i < argc; i++) {
+        if (!load_capture(argv[i]))
+            return 1;
+    }
+
+    if (!burst_count) {
+        fprintf(stderr, "No bursts to replay\n");
+        return 1;
+    }
+
+    ir_decoder_t *decoder = fujitsu_ac_ir_make_decoder();
+
+    fujitsu_ac_ir_stats_t stats_before, stats_after;
+    fujitsu_ac_ir_get_stats(&stats_before);
+
+    uint32_t decoded = 0;
+    fujitsu_ac_ir_result_t result;
+
+    allocations = 0;
+    uint64_t start = now_ns();
+    for (int iteration=0; iteration < iterations; iteration++) {
+        for (size_t i=0; i < burst_count; i++) {
+            burst_t *burst = &bursts[i];
+            int size = decoder->decode(decoder, pulses + burst->offset, burst->pulse_count,
+                                       &result, sizeof(result));
+            if (size > 0)
+                decoded++;
+
+            if (verbose && iteration == 0) {
+                char prompt[128];
+                snprintf(prompt, sizeof(prompt), "%s:%u", burst->file, burst->index);
+                if (size > 0) {
+                    fujitsu_ac_state_t unpacked;
+                    fujitsu_ac_state_unpack(result.state, &unpacked);
+                    unpacked.timer = result.timer;
+                    fujitsu_ac_print_state(prompt, &unpacked);
+                } else {
+                    printf("%s: %u pulses, %s\n", prompt, burst->pulse_count,
+                           fujitsu_ac_ir_error_string(-size));
+                }
+            }
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    uint32_t replay_allocations = allocations;
+
+    fujitsu_ac_ir_get_stats(&stats_after);
+    decoder->free(decoder);
+
+    uint64_t total = (uint64_t)burst_count * iterations;
+    printf("\nreplayed %zu bursts x %d iterations: %u decoded per pass\n",
+           burst_count, iterations, decoded / iterations);
+    printf("  %.0f bursts/s, %.1f ns/burst, %.3f allocations/burst\n",
+           total * 1e9 / elapsed, (double)elapsed / total, (double)replay_allocations / total);
+
+    for (int i=fujitsu_ac_ir_error_buffer; i < fujitsu_ac_ir_error_count; i++) {
+        uint32_t errors = stats_after.errors[i] - stats_before.errors[i];
+        if (errors)
+            printf("  %-12s %u per pass\n", fujitsu_ac_ir_error_string(i), errors / iterations);
+    }
+
+    return 0;
+}
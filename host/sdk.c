@@ -0,0 +1,26 @@
+// Host implementation of the ESP8266 SDK and FreeRTOS calls used by
+// the portable modules.
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <espressif/esp_system.h>
+#include <task.h>
+
+
+uint32_t sdk_system_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+
+static pthread_mutex_t critical_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void host_enter_critical(void) {
+    pthread_mutex_lock(&critical_mutex);
+}
+
+void host_exit_critical(void) {
+    pthread_mutex_unlock(&critical_mutex);
+}
@@ -0,0 +1,72 @@
+// Checks running mean, min, max and median of the sensor ring against a
+// brute force scan of the same window, over random walks with spikes like
+// a flaky DHT11 produces.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "sensor_ring.h"
+#include "check.h"
+
+
+#define READINGS 100000
+
+
+static int compare(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+
+int main() {
+    static int history[READINGS];
+    sensor_ring_t ring;
+    sensor_ring_init(&ring);
+
+    srand(1);
+    int value = 220;
+    int spikes = 0, rejected = 0;
+    for (int i=0; i < READINGS; i++) {
+        value += rand() % 3 - 1;
+        int reading = value;
+        if (rand() % 50 == 0) {
+            reading += (rand() % 2) ? 100 : -100;
+            spikes++;
+        }
+        history[i] = reading;
+
+        float median = sensor_ring_add(&ring, reading / 10.0f);
+
+        int window = (i + 1 < SENSOR_RING_SIZE) ? i + 1 : SENSOR_RING_SIZE;
+        int sum = 0, min = INT32_MAX, max = INT32_MIN;
+        for (int j=i + 1 - window; j <= i; j++) {
+            sum += history[j];
+            if (history[j] < min) min = history[j];
+            if (history[j] > max) max = history[j];
+        }
+
+        CHECK(fabsf(sensor_ring_mean(&ring) - sum / 10.0f / window) < 0.001f,
+              "reading %d: mean %g, expected %g", i, sensor_ring_mean(&ring), sum / 10.0f / window);
+        CHECK(roundf(sensor_ring_min(&ring) * 10) == min,
+              "reading %d: min %g, expected %g", i, sensor_ring_min(&ring), min / 10.0f);
+        CHECK(roundf(sensor_ring_max(&ring) * 10) == max,
+              "reading %d: max %g, expected %g", i, sensor_ring_max(&ring), max / 10.0f);
+
+        int sorted[SENSOR_MEDIAN_SIZE];
+        int n = (i + 1 < SENSOR_MEDIAN_SIZE) ? i + 1 : SENSOR_MEDIAN_SIZE;
+        for (int j=0; j < n; j++)
+            sorted[j] = history[i - j];
+        qsort(sorted, n, sizeof(int), compare);
+        CHECK(roundf(median * 10) == sorted[(n - 1) / 2],
+              "reading %d: median %g, expected %g", i, median, sorted[(n - 1) / 2] / 10.0f);
+
+        if (reading != value && abs((int)roundf(median * 10) - value) < 50)
+            rejected++;
+    }
+
+    printf("sensor ring: %d readings, %d of %d spikes rejected by median, %d failures\n",
+           READINGS, rejected, spikes, failures);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,97 @@
+// Simulates a room driven by the AUTO mode control loop with DHT11-like
+// readings (whole degrees, flickering between neighbours) every 10s for a
+// day. Checks that the loop heats when cold, cools when hot, keeps the
+// room near target, never switches faster than min dwell and switches
+// less often than a loop that follows every reading.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "thermostat_control.h"
+#include "check.h"
+
+
+#define POLL_PERIOD 10000   // ms
+#define DAY (24 * 3600 * 1000u)
+#define MIN_DWELL (300 * 1000)
+
+
+typedef struct {
+    float start;
+    float target;
+    thermostat_mode_t first_mode;
+} scenario_t;
+
+
+static void simulate(const scenario_t *scenario) {
+    thermostat_control_t control;
+    thermostat_control_init(&control, THERMOSTAT_HEAT_BAND, THERMOSTAT_COOL_BAND, MIN_DWELL);
+
+    srand(1);
+    float room = scenario->start;
+    uint32_t last_transition = 0;
+    float worst = 0;
+
+    for (uint32_t now=0; now < DAY; now += POLL_PERIOD) {
+        // Outside swings between 10C and 34C over the day
+        float outside = 22 + 12 * sinf(now * 2 * M_PI / DAY);
+        room += (outside - room) * 0.0005f;
+
+        float reading = roundf(room + (rand() % 3 - 1) * 0.4f);
+        uint32_t transitions = control.transitions;
+        bool valid = control.valid;
+        if (thermostat_control_update(&control, reading, scenario->target, now)) {
+            if (!valid) {
+                CHECK(control.mode == scenario->first_mode, "start %g: first mode %s",
+                      scenario->start, thermostat_mode_string(control.mode));
+            } else {
+                CHECK(control.transitions == transitions + 1, "transition not counted");
+                CHECK(now - last_transition >= MIN_DWELL, "switched after %u ms",
+                      now - last_transition);
+            }
+            last_transition = now;
+        }
+
+        switch (control.mode) {
+        case thermostat_mode_heat: room += 0.01f; break;
+        case thermostat_mode_cool: room -= 0.01f; break;
+        default: break;
+        }
+
+        // Allow two hours to get there from the start
+        if (now > 2 * 3600 * 1000 && fabsf(room - scenario->target) > worst)
+            worst = fabsf(room - scenario->target);
+    }
+
+    CHECK(control.transitions <= control.naive_transitions,
+          "start %g: %u transitions, %u switching on every reading",
+          scenario->start, control.transitions, control.naive_transitions);
+    CHECK(worst < THERMOSTAT_HEAT_BAND + THERMOSTAT_COOL_BAND + 1,
+          "start %g: room %g off target", scenario->start, worst);
+
+    printf("start %4.1fC target %4.1fC: %u readings, %u transitions, %u avoided, "
+           "%u held for min dwell, %.1fC max off target\n",
+           scenario->start, scenario->target, control.updates, control.transitions,
+           thermostat_control_avoided(&control), control.dwell_holds, worst);
+}
+
+
+int main() {
+    static const scenario_t scenarios[] = {
+        {.start = 15, .target = 22, .first_mode = thermostat_mode_heat},
+        {.start = 30, .target = 22, .first_mode = thermostat_mode_cool},
+        {.start = 22, .target = 22, .first_mode = thermostat_mode_fan},
+    };
+
+    for (int i=0; i < sizeof(scenarios) / sizeof(*scenarios); i++)
+        simulate(&scenarios[i]);
+
+    if (failures) {
+        printf("thermostat control: %d failures\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
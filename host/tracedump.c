@@ -0,0 +1,117 @@
+// Decodes trace dumps printed by the device ("t" on serial console) into
+// readable text. Reads a serial log on stdin, ignores everything outside
+// of TRACE BEGIN/END blocks.
+//
+//   make monitor | tee serial.log
+//   host/build/tracedump < serial.log
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "fujitsu_ac_ir.h"
+#include "trace.h"
+
+
+static const char *event_names[] = {
+#define TRACE_EVENT_NAME(name) #name,
+    TRACE_EVENTS(TRACE_EVENT_NAME)
+#undef TRACE_EVENT_NAME
+};
+
+
+static void print_record(const trace_record_t *record, uint32_t start_time) {
+    char prefix[64];
+    const char *name = (record->event < trace_event_count) ? event_names[record->event] : "unknown";
+    snprintf(prefix, sizeof(prefix), "%12.6f %-16s",
+             (record->timestamp - start_time) / 1000000.0, name);
+
+    switch (record->event) {
+    case trace_ir_send:
+    case trace_ir_send_failed:
+    case trace_ir_send_suppressed:
+    case trace_ir_decoded:
+    case trace_ir_echo:
+    case trace_remote_state: {
+        fujitsu_ac_state_t state;
+        fujitsu_ac_state_unpack(fujitsu_ac_state_expand(record->arg), &state);
+        if (record->error) {
+            printf("%s error=%d\n", prefix, record->error);
+        }
+        fujitsu_ac_print_state(prefix, &state);
+        break;
+    }
+    case trace_ir_decode_failed:
+        printf("%s: %d bytes, error=%d\n", prefix, record->arg, record->error);
+        break;
+    case trace_homekit_write:
+        printf("%s: unit=%d input=%d\n", prefix, record->arg >> 8, record->arg & 0xff);
+        break;
+    case trace_notify_flush:
+        printf("%s: dirty=0x%02x\n", prefix, record->arg);
+        break;
+    case trace_sensor_reading:
+        printf("%s: temperature=%.1f\n", prefix, (int16_t)record->arg / 10.0);
+        break;
+    case trace_sensor_deferred:
+        printf("%s: defers=%d\n", prefix, record->arg);
+        break;
+    case trace_ir_send_timer:
+        printf("%s: type=%d minutes=%d\n", prefix, record->error, record->arg);
+        break;
+    case trace_model_detected:
+        printf("%s: unit=%d model=%d\n", prefix, record->arg >> 8, record->arg & 0xff);
+        break;
+    case trace_ir_nec:
+        printf("%s: address=0x%02x command=0x%02x\n", prefix, record->arg >> 8, record->arg & 0xff);
+        break;
+    default:
+        printf("%s: arg=0x%04x error=%d\n", prefix, record->arg, record->error);
+    }
+}
+
+
+int main() {
+    char line[256];
+    int in_dump = 0;
+    uint32_t start_time = 0;
+    int first = 0;
+
+    while (fgets(line, sizeof(line), stdin)) {
+        char *p = strstr(line, "TRACE ");
+        if (!p)
+            continue;
+
+        unsigned count, skipped;
+        if (sscanf(p, "TRACE BEGIN %u %u", &count, &skipped) == 2) {
+            printf("--- %u records (%u older ones overwritten) ---\n", count, skipped);
+            in_dump = 1;
+            first = 1;
+            continue;
+        }
+
+        if (!strncmp(p, "TRACE END", 9)) {
+            in_dump = 0;
+            continue;
+        }
+
+        unsigned timestamp, event, error, arg;
+        if (!in_dump || sscanf(p, "TRACE %8x%2x%2x%4x", &timestamp, &event, &error, &arg) != 4)
+            continue;
+
+        trace_record_t record = {
+            .timestamp = timestamp,
+            .event = event,
+            .error = (int8_t)error,
+            .arg = arg,
+        };
+
+        if (first) {
+            start_time = record.timestamp;
+            first = 0;
+        }
+
+        print_record(&record, start_time);
+    }
+
+    return 0;
+}
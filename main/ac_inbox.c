@@ -0,0 +1,65 @@
+#include <string.h>
+
+#include <FreeRTOS.h>
+#include <task.h>
+#include <espressif/esp_system.h>
+
+#include "ac_inbox.h"
+
+
+void ac_inbox_init(ac_inbox_t *inbox) {
+    memset(inbox, 0, sizeof(*inbox));
+}
+
+
+void ac_inbox_post(ac_inbox_t *inbox, ac_input_t input, const ac_input_value_t *value) {
+    uint32_t now = sdk_system_get_time();
+
+    taskENTER_CRITICAL();
+
+    inbox->values[input] = *value;
+    inbox->input_time[input] = now;
+    inbox->input_seq[input] = ++inbox->seq;
+    inbox->pending |= AC_INPUT_BIT(input);
+
+    taskEXIT_CRITICAL();
+}
+
+
+uint32_t ac_inbox_pending(ac_inbox_t *inbox) {
+    taskENTER_CRITICAL();
+    uint32_t pending = inbox->pending;
+    taskEXIT_CRITICAL();
+
+    return pending;
+}
+
+
+uint32_t ac_inbox_take(ac_inbox_t *inbox, ac_inbox_t *snapshot) {
+    taskENTER_CRITICAL();
+
+    uint32_t pending = inbox->pending;
+    for (int i=0; i < ac_input_count; i++) {
+        if (pending & AC_INPUT_BIT(i)) {
+            snapshot->values[i] = inbox->values[i];
+            snapshot->input_seq[i] = inbox->input_seq[i];
+            snapshot->input_time[i] = inbox->input_time[i];
+        }
+    }
+    snapshot->pending = pending;
+    snapshot->seq = inbox->seq;
+    inbox->pending = 0;
+
+    taskEXIT_CRITICAL();
+
+    return pending;
+}
+
+
+bool ac_inbox_superseded(const ac_inbox_t *snapshot, ac_input_t input) {
+    if (!(snapshot->pending & AC_INPUT_BIT(ac_input_remote)) || input == ac_input_remote)
+        return false;
+
+    // sequence numbers wrap around, compare difference
+    return (int32_t)(snapshot->input_seq[input] - snapshot->input_seq[ac_input_remote]) < 0;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "fujitsu_ac_ir.h"
+
+
+// Inputs that change AC state. Each one has a single latest-value slot,
+// so posting never blocks and never loses the most recent value.
+typedef enum {
+    ac_input_remote = 0,    // full state received from IR remote
+    ac_input_target_state,
+    ac_input_target_temperature,
+    ac_input_fan_active,
+    ac_input_fan_rotation_speed,
+    ac_input_fan_swing_mode,
+    ac_input_current_temperature,
+    ac_input_timer,         // minutes, > 0 turn on, < 0 turn off, 0 cancels all
+    ac_input_model,         // model detected from remote frames, to send in
+    ac_input_timing,        // remote timing learned by decoder, to save
+
+    ac_input_count,
+} ac_input_t;
+
+#define AC_INPUT_BIT(input) (1 << (input))
+
+#define AC_INPUT_HOMEKIT_MASK ( \
+    AC_INPUT_BIT(ac_input_target_state) | \
+    AC_INPUT_BIT(ac_input_target_temperature) | \
+    AC_INPUT_BIT(ac_input_fan_active) | \
+    AC_INPUT_BIT(ac_input_fan_rotation_speed) | \
+    AC_INPUT_BIT(ac_input_fan_swing_mode) \
+)
+
+
+typedef union {
+    int int_value;
+    float float_value;
+    fujitsu_ac_packed_state_t ac_state;
+} ac_input_value_t;
+
+
+typedef struct {
+    uint32_t pending;
+    uint32_t seq;
+
+    uint32_t input_seq[ac_input_count];
+    uint32_t input_time[ac_input_count];  // us, when input was posted
+    ac_input_value_t values[ac_input_count];
+} ac_inbox_t;
+
+
+void ac_inbox_init(ac_inbox_t *inbox);
+
+// Store latest value of an input. Safe to call from any task.
+void ac_inbox_post(ac_inbox_t *inbox, ac_input_t input, const ac_input_value_t *value);
+
+// Bitmask of inputs posted since last take
+uint32_t ac_inbox_pending(ac_inbox_t *inbox);
+
+// Move all pending inputs into snapshot and clear them in inbox.
+// Only the owner task should call this. Returns bitmask of inputs taken.
+uint32_t ac_inbox_take(ac_inbox_t *inbox, ac_inbox_t *snapshot);
+
+// True if input in snapshot was posted before a remote state that
+// is also in the snapshot, i.e. the remote press overrides it
+bool ac_inbox_superseded(const ac_inbox_t *snapshot, ac_input_t input);
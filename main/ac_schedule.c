@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ac_schedule.h"
+
+
+void ac_schedule_init(ac_schedule_t *schedule) {
+    memset(schedule, 0, sizeof(*schedule));
+}
+
+bool ac_schedule_add(ac_schedule_t *schedule, uint32_t now, int minutes) {
+    if (!minutes) {
+        schedule->count = 0;
+        return true;
+    }
+
+    if (schedule->count >= AC_SCHEDULE_SIZE)
+        return false;
+
+    ac_event_t event = {
+        .time = now + abs(minutes) * AC_SCHEDULE_MINUTE,
+        .on = minutes > 0,
+    };
+
+    int i = schedule->count++;
+    for (; i > 0 && (int32_t)(schedule->events[i-1].time - event.time) > 0; i--)
+        schedule->events[i] = schedule->events[i-1];
+    schedule->events[i] = event;
+
+    // AC's timer holds the one that used to be next
+    if (i == 0)
+        schedule->timer_armed = false;
+
+    return true;
+}
+
+fujitsu_ac_timer_t ac_schedule_timer(const ac_schedule_t *schedule, uint32_t now) {
+    fujitsu_ac_timer_t timer = {ac_timer_none, 0, 0};
+    if (!schedule->count)
+        return timer;
+
+    int32_t ms = schedule->events[0].time - now;
+    uint32_t minutes = (ms > 0) ? (ms + AC_SCHEDULE_MINUTE - 1) / AC_SCHEDULE_MINUTE : 1;
+    if (minutes > FUJITSU_AC_TIMER_MAX_MINUTES)
+        return timer;
+
+    if (schedule->events[0].on) {
+        timer.type = ac_timer_on;
+        timer.on_minutes = minutes;
+    } else {
+        timer.type = ac_timer_off;
+        timer.off_minutes = minutes;
+    }
+
+    return timer;
+}
+
+bool ac_schedule_stale(const ac_schedule_t *schedule, uint32_t now) {
+    if (!schedule->count)
+        return schedule->timer_armed;
+
+    return !schedule->timer_armed && ac_schedule_timer(schedule, now).type != ac_timer_none;
+}
+
+void ac_schedule_frame(ac_schedule_t *schedule, fujitsu_ac_packed_state_t state,
+                       const fujitsu_ac_timer_t *timer) {
+    uint8_t command = state >> 24;
+    if (command && command != ac_cmd_turn_off)
+        return;
+
+    schedule->timer_armed = !command && timer && timer->type != ac_timer_none;
+}
+
+bool ac_schedule_due(const ac_schedule_t *schedule, uint32_t now) {
+    return schedule->count && (int32_t)(now - schedule->events[0].time) >= 0;
+}
+
+bool ac_schedule_take(ac_schedule_t *schedule, uint32_t now, ac_event_t *event, bool *by_timer) {
+    if (!ac_schedule_due(schedule, now))
+        return false;
+
+    *event = schedule->events[0];
+    *by_timer = schedule->timer_armed;
+
+    schedule->count--;
+    memmove(schedule->events, schedule->events + 1, schedule->count * sizeof(ac_event_t));
+    schedule->timer_armed = false;
+    schedule->events_done++;
+
+    return true;
+}
+
+uint32_t ac_schedule_wait(const ac_schedule_t *schedule, uint32_t now) {
+    if (!schedule->count)
+        return UINT32_MAX;
+
+    int32_t ms = schedule->events[0].time - now;
+    if (!schedule->timer_armed) {
+        // Out of timer range, or a timer frame is still to be sent
+        int32_t in_range = ms - FUJITSU_AC_TIMER_MAX_MINUTES * AC_SCHEDULE_MINUTE;
+        ms = (in_range > 0) ? in_range : (ms < AC_SCHEDULE_MINUTE ? ms : AC_SCHEDULE_MINUTE);
+    }
+
+    return (ms > 0) ? ms : 0;
+}
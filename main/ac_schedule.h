@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "fujitsu_ac_ir.h"
+
+
+// Scheduled AC on/off events. The next one is kept in AC's own timer, so
+// nothing has to be sent when it is due.
+#ifndef AC_SCHEDULE_SIZE
+#define AC_SCHEDULE_SIZE 4
+#endif
+
+#define AC_SCHEDULE_MINUTE (60 * 1000)  // ms
+
+
+typedef struct {
+    uint32_t time;  // ms
+    bool on;
+} ac_event_t;
+
+typedef struct {
+    // Pending events, soonest first
+    ac_event_t events[AC_SCHEDULE_SIZE];
+    int count;
+
+    // AC's timer holds events[0]
+    bool timer_armed;
+
+    uint32_t events_done;
+} ac_schedule_t;
+
+
+void ac_schedule_init(ac_schedule_t *schedule);
+
+// Add event in given number of minutes from now: turn AC on (> 0) or off
+// (< 0). 0 drops all events. Returns false if schedule is full.
+bool ac_schedule_add(ac_schedule_t *schedule, uint32_t now, int minutes);
+
+// Next event as AC timer setting, none if there is none or it is too far
+// ahead for the timer fields
+fujitsu_ac_timer_t ac_schedule_timer(const ac_schedule_t *schedule, uint32_t now);
+
+// True if AC's timer has to be set to the next event or stopped
+bool ac_schedule_stale(const ac_schedule_t *schedule, uint32_t now);
+
+// Frame AC took: one that was sent with given timer (NULL if none) or one
+// from its own remote (NULL). Turn off and full state frames stop AC's
+// timer, the latter set it again if they carry one; louver steps leave it.
+void ac_schedule_frame(ac_schedule_t *schedule, fujitsu_ac_packed_state_t state,
+                       const fujitsu_ac_timer_t *timer);
+
+// True if the next event is due
+bool ac_schedule_due(const ac_schedule_t *schedule, uint32_t now);
+
+// Take the next event if it is due. by_timer tells if AC's timer has
+// already carried it out.
+bool ac_schedule_take(ac_schedule_t *schedule, uint32_t now, ac_event_t *event, bool *by_timer);
+
+// ms until the next event is due or, if it is not in AC's timer, until it
+// is worth another look; UINT32_MAX if there are no events
+uint32_t ac_schedule_wait(const ac_schedule_t *schedule, uint32_t now);
@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+
+ARENA_DEFINE(decoder_arena, DECODER_ARENA_SIZE);
+
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    size = (size + 7) & ~7;
+    if (arena->used + size > arena->size) {
+        if (arena->size)
+            arena->overflows++;
+        return malloc(size);
+    }
+
+    void *ptr = arena->memory + arena->used;
+    arena->used += size;
+
+    return ptr;
+}
+
+void arena_free(arena_t *arena, void *ptr) {
+    if ((uint8_t*)ptr >= arena->memory && (uint8_t*)ptr < arena->memory + arena->size)
+        return;
+
+    free(ptr);
+}
+
+void arena_print(const arena_t *arena) {
+    printf("%s: %u/%u bytes used, %u overflows\n",
+           arena->name, (unsigned)arena->used, (unsigned)arena->size, arena->overflows);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// With STATIC_ALLOCATION=1 long-lived objects (IR decoders, accessory name,
+// task stacks) are carved from statically sized arenas instead of the heap,
+// leaving the heap to HomeKit pairing crypto. Run "make footprint" for the
+// sizes. Otherwise arenas fall through to malloc().
+#ifndef STATIC_ALLOCATION
+#define STATIC_ALLOCATION 0
+#endif
+
+typedef struct {
+    const char *name;
+    uint8_t *memory;
+    size_t size;
+    size_t used;
+    uint32_t overflows;  // allocations that did not fit and went to heap
+} arena_t;
+
+#if STATIC_ALLOCATION
+#define ARENA_DEFINE(var, arena_size) \
+    static uint8_t var##_memory[arena_size] __attribute__((aligned(8))); \
+    arena_t var = {.name = #var, .memory = var##_memory, .size = arena_size}
+#else
+#define ARENA_DEFINE(var, arena_size) \
+    arena_t var = {.name = #var}
+#endif
+
+
+// Bytes for IR decoders: Fujitsu decoder, dispatcher and capture wrapper
+#ifndef DECODER_ARENA_SIZE
+#define DECODER_ARENA_SIZE 96
+#endif
+
+extern arena_t decoder_arena;
+
+
+// Objects are never returned to an arena; if one does not fit, it is
+// allocated from heap instead. Not thread safe, meant for startup.
+void *arena_alloc(arena_t *arena, size_t size);
+
+// Frees heap allocated objects, arena objects stay until reboot
+void arena_free(arena_t *arena, void *ptr);
+
+void arena_print(const arena_t *arena);
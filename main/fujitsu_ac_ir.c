@@ -1,10 +1,17 @@
 #include <stdint.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <espressif/esp_system.h>
 
 #include "fujitsu_ac_ir.h"
+#include "trace.h"
+#include "arena.h"
 #include <ir/ir.h>
+#include <ir/raw.h>
 #include <ir/generic.h>
 
 
@@ -28,7 +35,7 @@ static const char* ac_cmd_string(ac_cmd command) {
 static const char* ac_mode_string(ac_mode mode) {
     static char* strings[] = {"auto", "cool", "dry", "fan", "heat"};
     static char unknown[5];
-    if (mode > countof(strings)) {
+    if (mode >= countof(strings)) {
         snprintf(unknown, sizeof(unknown), "0x%02x", mode & 0xff);
         return unknown;
     }
@@ -39,7 +46,7 @@ static const char* ac_mode_string(ac_mode mode) {
 static const char* ac_fan_string(ac_fan fan) {
     static char* strings[] = {"auto", "high", "med", "low", "quiet"};
     static char unknown[5];
-    if (fan > countof(strings)) {
+    if (fan >= countof(strings)) {
         snprintf(unknown, sizeof(unknown), "0x%02x", fan & 0xff);
         return unknown;
     }
@@ -49,16 +56,16 @@ static const char* ac_fan_string(ac_fan fan) {
 static const char* ac_swing_string(ac_swing swing) {
     static char* strings[] = {"off", "vert", "horiz", "both"};
     static char unknown[5];
-    if (swing > countof(strings)) {
+    if (swing >= countof(strings)) {
         snprintf(unknown, sizeof(unknown), "0x%02x", swing & 0xff);
         return unknown;
     }
     return strings[swing];
 }
 
-static void print_state(const char *prompt, fujitsu_ac_state_t *state) {
+void fujitsu_ac_print_state(const char *prompt, fujitsu_ac_state_t *state) {
     printf(
-        "%s: command=%s mode=%s fan=%s swing=%s temperature=%d\n",
+        "%s: command=%s mode=%s fan=%s swing=%s temperature=%d",
         prompt,
         ac_cmd_string(state->command),
         ac_mode_string(state->mode),
@@ -66,10 +73,175 @@ static void print_state(const char *prompt, fujitsu_ac_state_t *state) {
         ac_swing_string(state->swing),
         state->temperature
     );
+
+    switch (state->timer.type) {
+    case ac_timer_sleep:
+        printf(" timer=sleep in %umin", state->timer.off_minutes);
+        break;
+    case ac_timer_off:
+        printf(" timer=off in %umin", state->timer.off_minutes);
+        break;
+    case ac_timer_on:
+        printf(" timer=on in %umin", state->timer.on_minutes);
+        break;
+    default:
+        break;
+    }
+    printf("\n");
+}
+
+
+const char *fujitsu_ac_ir_error_string(fujitsu_ac_ir_error_t error) {
+    static const char *strings[] = {
+        "none", "buffer", "header", "preamble", "bit timing", "length",
+        "inverted", "model", "extended", "trailer", "checksum", "echo",
+    };
+    if (error >= countof(strings))
+        return "unknown";
+
+    return strings[error];
+}
+
+
+static const ac_cmd packed_commands[] = {
+    ac_cmd_stay_on, ac_cmd_turn_on, ac_cmd_turn_off, ac_cmd_step_horiz, ac_cmd_step_vert,
+};
+
+uint16_t fujitsu_ac_state_compact(fujitsu_ac_packed_state_t packed) {
+    fujitsu_ac_state_t state;
+    fujitsu_ac_state_unpack(packed, &state);
+
+    uint16_t command = 0;
+    for (int i=0; i < countof(packed_commands); i++)
+        if (packed_commands[i] == state.command)
+            command = i;
+
+    return ((state.temperature - AC_MIN_TEMPERATURE) & 0xf) |
+        ((state.mode & 0x7) << 4) |
+        ((state.fan & 0x7) << 7) |
+        ((state.swing & 0x3) << 10) |
+        (command << 12);
+}
+
+fujitsu_ac_packed_state_t fujitsu_ac_state_expand(uint16_t compact) {
+    uint8_t command = (compact >> 12) & 0xf;
+
+    fujitsu_ac_state_t state;
+    state.command = (command < countof(packed_commands)) ? packed_commands[command] : ac_cmd_stay_on;
+    state.temperature = AC_MIN_TEMPERATURE + (compact & 0xf);
+    state.mode = (compact >> 4) & 0x7;
+    state.fan = (compact >> 7) & 0x7;
+    state.swing = (compact >> 10) & 0x3;
+
+    return fujitsu_ac_state_pack(&state);
+}
+
+
+// Frame layout of a model. Short commands are
+//   preamble | command [| ~command]
+// and full state frames are
+//   preamble | id | 9 | 0x30 | state (6 bytes) [| trailer] | checksum
+// where checksum = checksum_base - sum(cmd[checksum_start .. size-2]).
+typedef struct {
+    fujitsu_ac_model model;
+    uint8_t id;              // cmd[5] of a full state frame
+    uint8_t size;            // full state frame size
+    uint8_t short_size;      // short command frame size, 7 adds inverted command byte
+    uint8_t trailer;         // fills cmd[14 .. size-2]
+    uint8_t checksum_start;
+    uint8_t checksum_base;
+} fujitsu_ac_model_desc_t;
+
+static const fujitsu_ac_model_desc_t fujitsu_ac_models[] = {
+    {
+        .model = fujitsu_ac_model_ARRAH2E,
+        .id = 0xfe,
+        .size = 16,
+        .short_size = 7,
+        .trailer = 0x20,
+        .checksum_start = 7,
+        .checksum_base = 0x00,
+    },
+    {
+        .model = fujitsu_ac_model_ARDB1,
+        .id = 0xfc,
+        .size = 15,
+        .short_size = 6,
+        .checksum_start = 0,
+        .checksum_base = 0x9b,
+    },
+};
+
+static const uint8_t fujitsu_ac_preamble[] = {0x14, 0x63, 0x00, 0x10, 0x10};
+
+#define FUJITSU_AC_TRAILER_OFFSET 14
+#define FUJITSU_AC_MAX_FRAME_SIZE 16
+
+
+static const fujitsu_ac_model_desc_t *fujitsu_ac_model_by_id(uint8_t id) {
+    for (int i=0; i < countof(fujitsu_ac_models); i++)
+        if (fujitsu_ac_models[i].id == id)
+            return &fujitsu_ac_models[i];
+
+    return NULL;
+}
+
+static const fujitsu_ac_model_desc_t *fujitsu_ac_model_by_short_size(uint8_t size) {
+    for (int i=0; i < countof(fujitsu_ac_models); i++)
+        if (fujitsu_ac_models[i].short_size == size)
+            return &fujitsu_ac_models[i];
+
+    return NULL;
+}
+
+static inline uint8_t fujitsu_ac_checksum(const fujitsu_ac_model_desc_t *desc, const uint8_t *cmd) {
+    uint8_t checksum = desc->checksum_base;
+    for (int i=desc->checksum_start; i < desc->size - 1; i++)
+        checksum -= cmd[i];
+
+    return checksum;
 }
 
 
-static fujitsu_ac_model model;
+// FNV-1a hash of frame bytes, identifies transmitted frames when they
+// come back through the receiver
+static uint32_t fujitsu_ac_fingerprint(const uint8_t *cmd, size_t cmd_size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i=0; i < cmd_size; i++) {
+        hash ^= cmd[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+static const fujitsu_ac_model_desc_t *fujitsu_ac_model_by_frame(const uint8_t *cmd, int cmd_size) {
+    switch (cmd[5]) {
+    case ac_cmd_turn_off:
+    case ac_cmd_step_horiz:
+    case ac_cmd_step_vert:
+        return fujitsu_ac_model_by_short_size(cmd_size);
+    default:
+        return fujitsu_ac_model_by_id(cmd[5]);
+    }
+}
+
+
+static const fujitsu_ac_model_desc_t *model_desc = &fujitsu_ac_models[0];
+static fujitsu_ac_ir_stats_t stats;
+
+// Learned remote timing per model, decoder tries timing of the model it
+// decoded last first
+static uint16_t timing_scale[countof(fujitsu_ac_models)] = {
+    [0 ... countof(fujitsu_ac_models) - 1] = FUJITSU_AC_IR_TIMING_NOMINAL,
+};
+static volatile uint8_t timing_model = 0;
+
+// Last transmitted frame, to recognize its echo on the receiver
+static uint32_t echo_window = FUJITSU_AC_IR_ECHO_WINDOW * 1000;
+static volatile uint32_t echo_fingerprint;
+static volatile uint32_t echo_time;
 static ir_generic_config_t fujitsu_ac_ir_config = {
     .header_mark = 3200,
     .header_space = -1600,
@@ -86,190 +258,535 @@ static ir_generic_config_t fujitsu_ac_ir_config = {
     .tolerance = 20,
 };
 
+const ir_protocol_t fujitsu_ac_ir_protocol = {
+    .name = "Fujitsu",
+    .header_mark = 3200,
+    .header_space = -1600,
+#if FUJITSU_AC_IR_CALIBRATION_RANGE > 20
+    .tolerance = FUJITSU_AC_IR_CALIBRATION_RANGE,
+#else
+    .tolerance = 20,
+#endif
+    // shortest short command without footer .. full state frame with footer
+    .min_pulses = 2 + 6 * 8 * 2,
+    .max_pulses = 2 + FUJITSU_AC_MAX_FRAME_SIZE * 8 * 2 + 2,
+};
 
-void fujitsu_ac_ir_tx_init(fujitsu_ac_model ac_model) {
-    ir_tx_init();
-    model = ac_model;
-}
-
-int fujitsu_ac_ir_send(fujitsu_ac_state_t *state) {
-    uint8_t cmd[16];
-    size_t cmd_size = 16;
-    cmd[0] = 0x14;
-    cmd[1] = 0x63;
-    cmd[2] = 0x00;
-    cmd[3] = 0x10;
-    cmd[4] = 0x10;
 
-    switch (state->command) {
-    case ac_cmd_turn_off:
-    case ac_cmd_step_horiz:
-    case ac_cmd_step_vert:
-        cmd[5] = state->command;
+static size_t fujitsu_ac_ir_encode(fujitsu_ac_packed_state_t state, const fujitsu_ac_timer_t *timer,
+                                   uint8_t *cmd) {
+    const fujitsu_ac_model_desc_t *desc = model_desc;
 
-        if (model == fujitsu_ac_model_ARRAH2E) {
-            cmd[6] = ~cmd[5];
-            cmd_size = 7;
-        } else {
-            cmd_size = 6;
-        }
+    memcpy(cmd, fujitsu_ac_preamble, sizeof(fujitsu_ac_preamble));
 
-        break;
-    default:
-        switch (model) {
-        case fujitsu_ac_model_ARRAH2E:
-            cmd[5] = 0xfe;
-            break;
-        case fujitsu_ac_model_ARDB1:
-            cmd[5] = 0xfc;
-            break;
-        }
+    if (state >> 24) {
+        cmd[5] = state >> 24;
+        cmd[6] = ~cmd[5];
 
+        return desc->short_size;
+    } else {
+        cmd[5] = desc->id;
         cmd[6] = 9; // size of extended command
         cmd[7] = 0x30;
-        cmd[8] = (state->command == ac_cmd_turn_on) | ((state->temperature - AC_MIN_TEMPERATURE) << 4);
-        cmd[9] = state->mode | (0 /* timer off */ << 4);
-        cmd[10] = state->fan | (state->swing << 4);
+        cmd[8] = state;
+        cmd[9] = state >> 8;  // timer type in high nibble
+        cmd[10] = state >> 16;
         cmd[11] = 0x00; // timer off values
         cmd[12] = 0x00; // timer off/on values
         cmd[13] = 0x00; // timer on values
 
-        uint8_t checksum = 0;
+        if (timer && timer->type != ac_timer_none) {
+            uint16_t off = 0, on = 0;
+            if (timer->type == ac_timer_on) {
+                on = (timer->on_minutes & FUJITSU_AC_TIMER_MAX_MINUTES) | 0x800;
+            } else {
+                off = (timer->off_minutes & FUJITSU_AC_TIMER_MAX_MINUTES) | 0x800;
+            }
+
+            cmd[9] |= (timer->type & 0x3) << 4;
+            cmd[11] = off;
+            cmd[12] = (off >> 8) | (on << 4);
+            cmd[13] = on >> 4;
+        }
 
-        switch (model) {
-        case fujitsu_ac_model_ARRAH2E:
-            cmd[14] = 0x20;
+        for (int i=FUJITSU_AC_TRAILER_OFFSET; i < desc->size - 1; i++)
+            cmd[i] = desc->trailer;
 
-            for (int i=7; i < 16 - 1; i++)
-                checksum += cmd[i];
+        cmd[desc->size - 1] = fujitsu_ac_checksum(desc, cmd);
 
-            cmd[15] = -checksum;
-            cmd_size = 16;
-            break;
-        case fujitsu_ac_model_ARDB1:
-            for (int i=0; i < 14; i++)
-                checksum += cmd[i];
+        return desc->size;
+    }
+}
 
-            cmd[14] = 0x9B - checksum;
-            cmd_size = 15;
-            break;
+
+#if FUJITSU_AC_IR_CACHE_SIZE > 0
+
+// header + 2 pulses per bit + footer
+#define FUJITSU_AC_IR_MAX_PULSES (2 + FUJITSU_AC_MAX_FRAME_SIZE * 8 * 2 + 2)
+
+typedef struct {
+    fujitsu_ac_packed_state_t state;   // cache key, with model
+    uint8_t model;                     // index into fujitsu_ac_models
+    uint32_t fingerprint;
+    uint32_t last_used;
+    uint16_t pulse_count;
+    int16_t pulses[FUJITSU_AC_IR_MAX_PULSES];
+} fujitsu_ac_ir_cache_entry_t;
+
+static fujitsu_ac_ir_cache_entry_t cache[FUJITSU_AC_IR_CACHE_SIZE];
+static uint32_t cache_clock;
+
+
+static uint16_t fujitsu_ac_ir_render(uint8_t *cmd, size_t cmd_size, int16_t *pulses) {
+    ir_generic_config_t *config = &fujitsu_ac_ir_config;
+
+    uint16_t count = 0;
+    pulses[count++] = config->header_mark;
+    pulses[count++] = config->header_space;
+
+    for (size_t i=0; i < cmd_size; i++) {
+        for (int bit=0; bit < 8; bit++) {
+            if (cmd[i] & (1 << bit)) {
+                pulses[count++] = config->bit1_mark;
+                pulses[count++] = config->bit1_space;
+            } else {
+                pulses[count++] = config->bit0_mark;
+                pulses[count++] = config->bit0_space;
+            }
         }
     }
 
-    print_state("Sending state", state);
+    pulses[count++] = config->footer_mark;
+    pulses[count++] = config->footer_space;
+
+    return count;
+}
+
+
+static fujitsu_ac_ir_cache_entry_t *fujitsu_ac_ir_cache_get(fujitsu_ac_packed_state_t state) {
+    uint8_t model = model_desc - fujitsu_ac_models;
+
+    fujitsu_ac_ir_cache_entry_t *victim = &cache[0];
+    for (int i=0; i < FUJITSU_AC_IR_CACHE_SIZE; i++) {
+        fujitsu_ac_ir_cache_entry_t *entry = &cache[i];
+        if (entry->pulse_count && entry->state == state && entry->model == model) {
+            entry->last_used = ++cache_clock;
+            stats.cache_hits++;
+            return entry;
+        }
+
+        if (!entry->pulse_count || entry->last_used < victim->last_used)
+            victim = entry;
+    }
+
+    stats.cache_misses++;
+
+    uint8_t cmd[FUJITSU_AC_MAX_FRAME_SIZE];
+    size_t cmd_size = fujitsu_ac_ir_encode(state, NULL, cmd);
+
+    victim->state = state;
+    victim->model = model;
+    victim->fingerprint = fujitsu_ac_fingerprint(cmd, cmd_size);
+    victim->last_used = ++cache_clock;
+    victim->pulse_count = fujitsu_ac_ir_render(cmd, cmd_size, victim->pulses);
+
+    return victim;
+}
+
+#endif
+
+
+void fujitsu_ac_ir_tx_init(fujitsu_ac_model ac_model) {
+    ir_tx_init();
+
+#if FUJITSU_AC_IR_CACHE_SIZE > 0
+    memset(cache, 0, sizeof(cache));
+#endif
+
+    fujitsu_ac_ir_set_model(ac_model);
+    timing_model = model_desc - fujitsu_ac_models;
+}
+
+void fujitsu_ac_ir_set_model(fujitsu_ac_model ac_model) {
+    for (int i=0; i < countof(fujitsu_ac_models); i++)
+        if (fujitsu_ac_models[i].model == ac_model)
+            model_desc = &fujitsu_ac_models[i];
+}
+
+fujitsu_ac_model fujitsu_ac_ir_get_model() {
+    return model_desc->model;
+}
+
+bool fujitsu_ac_ir_model_valid(fujitsu_ac_model ac_model) {
+    for (int i=0; i < countof(fujitsu_ac_models); i++)
+        if (fujitsu_ac_models[i].model == ac_model)
+            return true;
+
+    return false;
+}
+
+
+static void fujitsu_ac_ir_record_echo(uint32_t fingerprint) {
+    echo_fingerprint = 0;
+    echo_time = sdk_system_get_time();
+    echo_fingerprint = fingerprint;
+}
+
+
+int fujitsu_ac_ir_send(fujitsu_ac_packed_state_t state) {
+    trace(trace_ir_send, fujitsu_ac_state_compact(state), 0);
+
+#if FUJITSU_AC_IR_CACHE_SIZE > 0
+    fujitsu_ac_ir_cache_entry_t *entry = fujitsu_ac_ir_cache_get(state);
+    fujitsu_ac_ir_record_echo(entry->fingerprint);
+
+    return ir_raw_send(entry->pulses, entry->pulse_count);
+#else
+    return fujitsu_ac_ir_send_timer(state, NULL);
+#endif
+}
+
+int fujitsu_ac_ir_send_timer(fujitsu_ac_packed_state_t state, const fujitsu_ac_timer_t *timer) {
+    if (timer)
+        trace(trace_ir_send_timer, timer->type == ac_timer_on ? timer->on_minutes : timer->off_minutes,
+              timer->type);
+
+    uint8_t cmd[FUJITSU_AC_MAX_FRAME_SIZE];
+    size_t cmd_size = fujitsu_ac_ir_encode(state, timer, cmd);
+    fujitsu_ac_ir_record_echo(fujitsu_ac_fingerprint(cmd, cmd_size));
 
     return ir_generic_send(&fujitsu_ac_ir_config, cmd, cmd_size);
 }
 
 
+void fujitsu_ac_ir_set_echo_window(uint32_t window) {
+    echo_window = window * 1000;
+}
+
+
+uint16_t fujitsu_ac_ir_get_timing(fujitsu_ac_model model) {
+    for (int i=0; i < countof(fujitsu_ac_models); i++)
+        if (fujitsu_ac_models[i].model == model)
+            return timing_scale[i];
+
+    return FUJITSU_AC_IR_TIMING_NOMINAL;
+}
+
+
+void fujitsu_ac_ir_set_timing(fujitsu_ac_model model, uint16_t scale) {
+    const uint16_t min_scale = FUJITSU_AC_IR_TIMING_NOMINAL * (100 - FUJITSU_AC_IR_CALIBRATION_RANGE) / 100;
+    const uint16_t max_scale = FUJITSU_AC_IR_TIMING_NOMINAL * (100 + FUJITSU_AC_IR_CALIBRATION_RANGE) / 100;
+    if (scale < min_scale || scale > max_scale)
+        return;
+
+    for (int i=0; i < countof(fujitsu_ac_models); i++)
+        if (fujitsu_ac_models[i].model == model)
+            timing_scale[i] = scale;
+}
+
+
+void fujitsu_ac_ir_get_stats(fujitsu_ac_ir_stats_t *result) {
+    *result = stats;
+}
+
+
+typedef struct {
+    int16_t min;
+    int16_t max;
+} fujitsu_ac_ir_range_t;
+
+typedef struct {
+    fujitsu_ac_ir_range_t header_mark;
+    fujitsu_ac_ir_range_t header_space;
+    fujitsu_ac_ir_range_t bit1_mark;
+    fujitsu_ac_ir_range_t bit1_space;
+    fujitsu_ac_ir_range_t bit0_mark;
+    fujitsu_ac_ir_range_t bit0_space;
+} fujitsu_ac_ir_timing_t;
+
 typedef struct {
     ir_decoder_t decoder;
-    ir_decoder_t *generic_decoder;
+
+    uint16_t timing_scale;  // scale timing ranges were computed for
+    fujitsu_ac_ir_timing_t timing;
 } fujitsu_ac_ir_decoder_t;
 
 
-static int fujitsu_ac_ir_decoder_decode(fujitsu_ac_ir_decoder_t *decoder,
-                                        int16_t *pulses, uint16_t pulse_count,
-                                        void *decode_buffer, uint16_t decode_buffer_size)
+static void fujitsu_ac_ir_range_init(fujitsu_ac_ir_range_t *range, int16_t value,
+                                     uint16_t scale, uint8_t tolerance) {
+    value = (int32_t)value * scale / FUJITSU_AC_IR_TIMING_NOMINAL;
+    int16_t delta = abs(value) * tolerance / 100;
+    range->min = value - delta;
+    range->max = value + delta;
+}
+
+static void fujitsu_ac_ir_timing_init(fujitsu_ac_ir_timing_t *timing, uint16_t scale) {
+    ir_generic_config_t *config = &fujitsu_ac_ir_config;
+    fujitsu_ac_ir_range_init(&timing->header_mark, config->header_mark, scale, config->tolerance);
+    fujitsu_ac_ir_range_init(&timing->header_space, config->header_space, scale, config->tolerance);
+    fujitsu_ac_ir_range_init(&timing->bit1_mark, config->bit1_mark, scale, config->tolerance);
+    fujitsu_ac_ir_range_init(&timing->bit1_space, config->bit1_space, scale, config->tolerance);
+    fujitsu_ac_ir_range_init(&timing->bit0_mark, config->bit0_mark, scale, config->tolerance);
+    fujitsu_ac_ir_range_init(&timing->bit0_space, config->bit0_space, scale, config->tolerance);
+}
+
+// Remote's timing estimated from frame header (mark + space), 0 if it is
+// too far off to be a Fujitsu header
+static uint16_t fujitsu_ac_ir_header_scale(int16_t *pulses, uint16_t pulse_count) {
+    if (pulse_count < 2 || pulses[0] <= 0 || pulses[1] >= 0)
+        return 0;
+
+    ir_generic_config_t *config = &fujitsu_ac_ir_config;
+    int32_t scale = (pulses[0] - pulses[1]) * FUJITSU_AC_IR_TIMING_NOMINAL /
+        (config->header_mark - config->header_space);
+
+    if (abs(scale - FUJITSU_AC_IR_TIMING_NOMINAL) >
+            FUJITSU_AC_IR_TIMING_NOMINAL * FUJITSU_AC_IR_CALIBRATION_RANGE / 100)
+        return 0;
+
+    return scale;
+}
+
+static inline bool fujitsu_ac_ir_in_range(int16_t value, const fujitsu_ac_ir_range_t *range) {
+    return value >= range->min && value <= range->max;
+}
+
+
+// Converts pulses to bytes one bit at a time, checking header timing and
+// preamble bytes as soon as they are complete, so that bursts from other
+// remotes are dropped after a few pulses. Returns number of decoded bytes
+// or negated fujitsu_ac_ir_error_t.
+static int fujitsu_ac_ir_decode_bits(const fujitsu_ac_ir_timing_t *timing,
+                                     int16_t *pulses, uint16_t pulse_count,
+                                     uint8_t *cmd)
 {
-    if (decode_buffer_size < sizeof(fujitsu_ac_state_t))
-        return -2;
+    if (pulse_count < 2)
+        return -fujitsu_ac_ir_error_header;
+
+    if (!fujitsu_ac_ir_in_range(pulses[0], &timing->header_mark) ||
+            !fujitsu_ac_ir_in_range(pulses[1], &timing->header_space))
+        return -fujitsu_ac_ir_error_header;
+
+    int cmd_size = 0;
+    uint8_t byte = 0;
+    uint8_t bit = 0;
+    for (int i=2; i + 1 < pulse_count; i += 2) {
+        if (fujitsu_ac_ir_in_range(pulses[i], &timing->bit1_mark) &&
+                fujitsu_ac_ir_in_range(pulses[i+1], &timing->bit1_space)) {
+            byte |= 1 << bit;
+        } else if (!fujitsu_ac_ir_in_range(pulses[i], &timing->bit0_mark) ||
+                !fujitsu_ac_ir_in_range(pulses[i+1], &timing->bit0_space)) {
+            // Footer can only come at a byte boundary
+            if (bit)
+                return -fujitsu_ac_ir_error_bit_timing;
+            break;
+        }
 
-    fujitsu_ac_state_t *state = decode_buffer;
+        if (++bit < 8)
+            continue;
 
-    uint8_t cmd[16];
-    int cmd_size = decoder->generic_decoder->decode(
-        decoder->generic_decoder, pulses, pulse_count, cmd, sizeof(cmd)
-    );
-    if (cmd_size <= 0)
-        return cmd_size;
+        if (cmd_size < sizeof(fujitsu_ac_preamble) && byte != fujitsu_ac_preamble[cmd_size])
+            return -fujitsu_ac_ir_error_preamble;
 
-    if (cmd_size < 6)
-        return -1;
+        if (cmd_size >= FUJITSU_AC_MAX_FRAME_SIZE)
+            return -fujitsu_ac_ir_error_length;
 
-    if (cmd[0] != 0x14 || cmd[1] != 0x63 || cmd[2] != 0x00 || cmd[3] != 0x10 || cmd[4] != 0x10)
-        return -1;
+        cmd[cmd_size++] = byte;
+        byte = 0;
+        bit = 0;
+    }
+
+    if (cmd_size < sizeof(fujitsu_ac_preamble))
+        return -fujitsu_ac_ir_error_preamble;
+
+    return cmd_size;
+}
+
+
+static void fujitsu_ac_ir_parse_timer(const uint8_t *cmd, fujitsu_ac_timer_t *timer) {
+    uint16_t off = cmd[11] | ((cmd[12] & 0x0f) << 8);
+    uint16_t on = (cmd[12] >> 4) | (cmd[13] << 4);
+
+    timer->type = (cmd[9] >> 4) & 0x3;
+    timer->off_minutes = (off & 0x800) ? (off & FUJITSU_AC_TIMER_MAX_MINUTES) : 0;
+    timer->on_minutes = (on & 0x800) ? (on & FUJITSU_AC_TIMER_MAX_MINUTES) : 0;
+}
+
+// Returns 0 or negated fujitsu_ac_ir_error_t. Timer is only set for full
+// state frames, if not NULL.
+static int fujitsu_ac_ir_parse(uint8_t *cmd, int cmd_size, fujitsu_ac_packed_state_t *state,
+                               fujitsu_ac_timer_t *timer) {
+    if (cmd_size < 6)
+        return -fujitsu_ac_ir_error_length;
 
     switch (cmd[5]) {
     case ac_cmd_turn_off:
     case ac_cmd_step_horiz:
     case ac_cmd_step_vert:
-        if ((cmd_size == 7) && (cmd[6] != (~cmd[5] & 0xff))) {
-            return -1;
-        } else if (cmd_size > 7) {
-            return -1;
-        }
+        if (!fujitsu_ac_model_by_short_size(cmd_size))
+            return -fujitsu_ac_ir_error_length;
+
+        if ((cmd_size == 7) && (cmd[6] != (~cmd[5] & 0xff)))
+            return -fujitsu_ac_ir_error_inverted;
 
-        state->command = cmd[5];
+        *state = (uint32_t)cmd[5] << 24;
 
         break;
-    case 0xfe:   // full state model ARRAH2E
-    case 0xfc: { // full state model ARDB1
-        fujitsu_ac_model model = (cmd[5] == 0xfe) ? fujitsu_ac_model_ARRAH2E : fujitsu_ac_model_ARDB1;
+    default: {
+        const fujitsu_ac_model_desc_t *desc = fujitsu_ac_model_by_id(cmd[5]);
+        if (!desc)
+            return -fujitsu_ac_ir_error_model;
+
+        if (cmd_size != desc->size)
+            return -fujitsu_ac_ir_error_length;
+
         if (cmd[6] != 9 || cmd[7] != 0x30)
-            return -1;
+            return -fujitsu_ac_ir_error_extended;
 
-        uint8_t checksum = 0;
-        switch (model) {
-        case fujitsu_ac_model_ARRAH2E:
-            if (cmd[14] != 0x20 || cmd_size != 16)
-                return -1;
+        for (int i=FUJITSU_AC_TRAILER_OFFSET; i < desc->size - 1; i++)
+            if (cmd[i] != desc->trailer)
+                return -fujitsu_ac_ir_error_trailer;
 
-            for (int i=7; i < 15; i++)
-                checksum += cmd[i];
+        if (cmd[desc->size - 1] != fujitsu_ac_checksum(desc, cmd))
+            return -fujitsu_ac_ir_error_checksum;
 
-            if (cmd[15] != (-checksum & 0xff))
-                return -1;
+        *state = (cmd[8] | (cmd[9] << 8) | (cmd[10] << 16)) & FUJITSU_AC_PACKED_STATE_MASK;
+        if (timer)
+            fujitsu_ac_ir_parse_timer(cmd, timer);
 
-            break;
+        break;
+    }
+    }
 
-        case fujitsu_ac_model_ARDB1:
-            if (cmd_size != 15)
-                return -1;
+    return 0;
+}
 
-            for (int i=0; i < 14; i++)
-                checksum += cmd[i];
 
-            if (cmd[14] != ((0x9B - checksum) & 0xff))
-                return -1;
+static int fujitsu_ac_ir_decoder_decode(fujitsu_ac_ir_decoder_t *decoder,
+                                        int16_t *pulses, uint16_t pulse_count,
+                                        void *decode_buffer, uint16_t decode_buffer_size)
+{
+    if (decode_buffer_size < sizeof(fujitsu_ac_packed_state_t)) {
+        stats.errors[fujitsu_ac_ir_error_buffer]++;
+        return -fujitsu_ac_ir_error_buffer;
+    }
 
-            break;
+    fujitsu_ac_packed_state_t *state = decode_buffer;
+
+    fujitsu_ac_ir_result_t *full_result = NULL;
+    fujitsu_ac_timer_t *timer = NULL;
+    if (decode_buffer_size >= sizeof(fujitsu_ac_ir_result_t)) {
+        full_result = decode_buffer;
+        timer = &full_result->timer;
+        timer->type = ac_timer_none;
+        timer->off_minutes = timer->on_minutes = 0;
+    }
+
+    uint32_t start_time = sdk_system_get_time();
+    stats.frames_received++;
+
+    uint16_t scale = timing_scale[timing_model];
+    if (decoder->timing_scale != scale) {
+        fujitsu_ac_ir_timing_init(&decoder->timing, scale);
+        decoder->timing_scale = scale;
+    }
+
+    uint8_t cmd[FUJITSU_AC_MAX_FRAME_SIZE];
+    int cmd_size = fujitsu_ac_ir_decode_bits(&decoder->timing, pulses, pulse_count, cmd);
+    int result = cmd_size;
+    if (cmd_size >= 0) {
+        result = fujitsu_ac_ir_parse(cmd, cmd_size, state, timer);
+    }
+
+    bool calibrated = false;
+#if FUJITSU_AC_IR_CALIBRATION_RANGE > 0
+    uint16_t frame_scale;
+    if (result < 0 && (frame_scale = fujitsu_ac_ir_header_scale(pulses, pulse_count)) &&
+            abs(frame_scale - scale) > FUJITSU_AC_IR_TIMING_NOMINAL / 50) {
+        // Weak batteries or drifting oscillator, retry with remote's own timing
+        fujitsu_ac_ir_timing_t timing;
+        fujitsu_ac_ir_timing_init(&timing, frame_scale);
+
+        uint8_t calibrated_cmd[FUJITSU_AC_MAX_FRAME_SIZE];
+        int calibrated_size = fujitsu_ac_ir_decode_bits(&timing, pulses, pulse_count, calibrated_cmd);
+        if (calibrated_size >= 0 && fujitsu_ac_ir_parse(calibrated_cmd, calibrated_size, state, timer) == 0) {
+            memcpy(cmd, calibrated_cmd, calibrated_size);
+            cmd_size = calibrated_size;
+            result = 0;
+            calibrated = true;
+
+            // Learn, averaging out receiver jitter on a single header
+            int m = fujitsu_ac_model_by_frame(cmd, cmd_size) - fujitsu_ac_models;
+            timing_scale[m] = (timing_scale[m] + frame_scale) / 2;
         }
+    }
+#endif
 
-        state->command = cmd[8] && 0xf;
-        state->temperature = AC_MIN_TEMPERATURE + (cmd[8] >> 4);
-        state->mode = cmd[9] & 0xf;
-        state->fan = cmd[10] & 0xf;
-        state->swing = cmd[10] >> 4;
+    if (result == 0) {
+        const fujitsu_ac_model_desc_t *desc = fujitsu_ac_model_by_frame(cmd, cmd_size);
+        timing_model = desc - fujitsu_ac_models;
+        if (full_result)
+            full_result->model = desc->model;
+    }
 
-        break;
+    if (result == 0 && echo_fingerprint &&
+            fujitsu_ac_fingerprint(cmd, cmd_size) == echo_fingerprint &&
+            start_time - echo_time < echo_window) {
+        // Our own transmission bounced back into the receiver
+        echo_fingerprint = 0;
+        result = -fujitsu_ac_ir_error_echo;
     }
-    default:
-        return -1;
+
+#if FUJITSU_AC_IR_CALIBRATION_RANGE > 0
+    if (result == 0 && !calibrated &&
+            (frame_scale = fujitsu_ac_ir_header_scale(pulses, pulse_count))) {
+        // Keep following the remote as it drifts further, a quarter of the
+        // way at a time, so that one jittery header barely moves it
+        timing_scale[timing_model] += (frame_scale - timing_scale[timing_model]) / 4;
+    }
+#endif
+
+    histogram_add(&stats.decode_time, sdk_system_get_time() - start_time);
+
+    if (result < 0) {
+        stats.errors[-result]++;
+
+        switch (-result) {
+        case fujitsu_ac_ir_error_header:
+        case fujitsu_ac_ir_error_preamble:
+            // other remotes, too common to trace
+            break;
+        case fujitsu_ac_ir_error_echo:
+            trace(trace_ir_echo, fujitsu_ac_state_compact(*state), 0);
+            break;
+        default:
+            trace(trace_ir_decode_failed, (cmd_size > 0) ? cmd_size : pulse_count, result);
+        }
+
+        return result;
     }
 
-    print_state("Decoded state", state);
+    stats.frames_decoded++;
+    if (calibrated)
+        stats.frames_calibrated++;
+    trace(trace_ir_decoded, fujitsu_ac_state_compact(*state), 0);
 
-    return sizeof(fujitsu_ac_state_t);
+    return full_result ? sizeof(fujitsu_ac_ir_result_t) : sizeof(fujitsu_ac_packed_state_t);
 }
 
 
 static void fujitsu_ac_ir_decoder_free(fujitsu_ac_ir_decoder_t *decoder) {
-    decoder->generic_decoder->free(decoder->generic_decoder);
-    free(decoder);
+    arena_free(&decoder_arena, decoder);
 }
 
 
 ir_decoder_t *fujitsu_ac_ir_make_decoder() {
-    fujitsu_ac_ir_decoder_t *decoder = malloc(sizeof(fujitsu_ac_ir_decoder_t));
+    fujitsu_ac_ir_decoder_t *decoder = arena_alloc(&decoder_arena, sizeof(fujitsu_ac_ir_decoder_t));
     if (!decoder)
         return NULL;
 
-    decoder->generic_decoder = ir_generic_make_decoder(&fujitsu_ac_ir_config);
-    if (!decoder->generic_decoder) {
-        free(decoder);
-        return NULL;
-    }
+    decoder->timing_scale = FUJITSU_AC_IR_TIMING_NOMINAL;
+    fujitsu_ac_ir_timing_init(&decoder->timing, decoder->timing_scale);
 
     decoder->decoder.decode = (ir_decoder_decode_t) fujitsu_ac_ir_decoder_decode;
     decoder->decoder.free = (ir_decoder_free_t) fujitsu_ac_ir_decoder_free;
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <ir/ir.h>
 
+#include "histogram.h"
+#include "ir_dispatch.h"
+
 
 typedef enum {
     fujitsu_ac_model_ARRAH2E = 1,
@@ -41,12 +45,81 @@ typedef enum {
     ac_swing_both = 0x03,
 } ac_swing;
 
+// AC's built-in timer. A full state frame without one stops a running timer.
+typedef enum {
+    ac_timer_none = 0x00,
+    ac_timer_sleep = 0x01,
+    ac_timer_off = 0x02,
+    ac_timer_on = 0x03,
+} ac_timer;
+
+
+// Number of rendered pulse trains kept for repeated sends (~540 bytes of
+// RAM each), 0 disables the cache and renders every frame on the fly.
+// Repeats of the last state are not sent at all and refreshes are off by
+// default, so it only pays off with refreshes or units sharing states.
+#ifndef FUJITSU_AC_IR_CACHE_SIZE
+#define FUJITSU_AC_IR_CACHE_SIZE 0
+#endif
+
+// Time (ms) after a transmission during which receiving the very same frame
+// is treated as its echo and dropped, 0 disables
+#ifndef FUJITSU_AC_IR_ECHO_WINDOW
+#define FUJITSU_AC_IR_ECHO_WINDOW 500
+#endif
+
+// Adaptive timing: a burst that fails to decode with the learned timing is
+// retried with bit thresholds rescaled from its own header, if the header
+// is within this many percent of nominal, and learned timing follows
+// headers of decoded frames. 0 disables
+#ifndef FUJITSU_AC_IR_CALIBRATION_RANGE
+#define FUJITSU_AC_IR_CALIBRATION_RANGE 40
+#endif
+
+// Timing scale, permille of nominal fujitsu_ac_ir_config timings
+#define FUJITSU_AC_IR_TIMING_NOMINAL 1000
+
+// Why decoder rejected a burst; decoder returns these negated
+typedef enum {
+    fujitsu_ac_ir_error_none = 0,
+    fujitsu_ac_ir_error_buffer,      // decode buffer too small
+    fujitsu_ac_ir_error_header,      // header mark/space timing mismatch
+    fujitsu_ac_ir_error_preamble,    // not a Fujitsu frame
+    fujitsu_ac_ir_error_bit_timing,  // pulse pair neither 0 nor 1 in the middle of a byte
+    fujitsu_ac_ir_error_length,      // wrong frame size for its type/model
+    fujitsu_ac_ir_error_inverted,    // short command and its inverted copy differ
+    fujitsu_ac_ir_error_model,       // unknown full state frame id (cmd[5])
+    fujitsu_ac_ir_error_extended,    // unexpected extended command size/type (cmd[6..7])
+    fujitsu_ac_ir_error_trailer,     // wrong model trailer byte
+    fujitsu_ac_ir_error_checksum,
+    fujitsu_ac_ir_error_echo,        // valid frame, but an echo of our own transmission
+
+    fujitsu_ac_ir_error_count,
+} fujitsu_ac_ir_error_t;
+
+// Decoder result for a frame that is an echo of our own transmission
+#define FUJITSU_AC_IR_ECHO (-fujitsu_ac_ir_error_echo)
+
+const char *fujitsu_ac_ir_error_string(fujitsu_ac_ir_error_t error);
+
 
 #define AC_MIN_TEMPERATURE 16
 #define AC_MAX_TEMPERATURE 30
 
 
 
+// Timer fields of a full state frame: type in cmd[9] bits 4-5, off (or
+// sleep) and on delays as 11-bit minutes, each followed by an enable bit,
+// in cmd[11..13]. Delays count from when AC receives the frame.
+#define FUJITSU_AC_TIMER_MAX_MINUTES 0x7ff
+
+typedef struct {
+    ac_timer type;
+    uint16_t off_minutes;  // off and sleep timers
+    uint16_t on_minutes;
+} fujitsu_ac_timer_t;
+
+
 typedef struct {
     ac_cmd command;
 
@@ -54,10 +127,117 @@ typedef struct {
     ac_fan fan;
     ac_swing swing;
     uint8_t temperature;
+
+    // Not part of the packed state: timers are one-off, see
+    // fujitsu_ac_ir_send_timer()
+    fujitsu_ac_timer_t timer;
 } fujitsu_ac_state_t;
 
 
+// Canonical packed AC state, the unit passed to the codec, between tasks and
+// used as cache key. Bits 0-23 are bytes cmd[8], cmd[9] and cmd[10] of a
+// full state frame exactly as on the wire:
+//   bit 0      power (turn on / stay on)
+//   bits 4-7   temperature - AC_MIN_TEMPERATURE
+//   bits 8-11  mode
+//   bits 16-19 fan
+//   bits 20-23 swing
+// Short commands (turn off, louver steps) carry no state: bits 24-31 hold
+// the command (cmd[5]) and the rest is zero.
+typedef uint32_t fujitsu_ac_packed_state_t;
+
+// Bits of cmd[8..10] that belong to the state
+#define FUJITSU_AC_PACKED_STATE_MASK 0x00ff0ff1
+
+static inline fujitsu_ac_packed_state_t fujitsu_ac_state_pack(const fujitsu_ac_state_t *state) {
+    switch (state->command) {
+    case ac_cmd_turn_off:
+    case ac_cmd_step_horiz:
+    case ac_cmd_step_vert:
+        return (uint32_t)state->command << 24;
+    default:
+        return (state->command == ac_cmd_turn_on) |
+            (((state->temperature - AC_MIN_TEMPERATURE) & 0xf) << 4) |
+            ((state->mode & 0xf) << 8) |
+            ((state->fan & 0xf) << 16) |
+            ((state->swing & 0xf) << 20);
+    }
+}
+
+static inline void fujitsu_ac_state_unpack(fujitsu_ac_packed_state_t packed, fujitsu_ac_state_t *state) {
+    state->command = (packed >> 24) ? (ac_cmd)(packed >> 24) : (ac_cmd)(packed & 0x1);
+    state->temperature = AC_MIN_TEMPERATURE + ((packed >> 4) & 0xf);
+    state->mode = (packed >> 8) & 0xf;
+    state->fan = (packed >> 16) & 0xf;
+    state->swing = (packed >> 20) & 0xf;
+    state->timer = (fujitsu_ac_timer_t) {ac_timer_none, 0, 0};
+}
+
+// True if an AC that took frame a needs no frame to get to state b. The
+// power bit only tells whether the frame switched AC on: a remote sends
+// "stay on" with the very state we send as "turn on".
+static inline bool fujitsu_ac_state_same(fujitsu_ac_packed_state_t a, fujitsu_ac_packed_state_t b) {
+    return ((a ^ b) & ~(fujitsu_ac_packed_state_t)1) == 0;
+}
+
+// 16-bit form of a packed state for trace records: temperature offset in
+// bits 0-3, mode 4-6, fan 7-9, swing 10-11, command index 12-15
+uint16_t fujitsu_ac_state_compact(fujitsu_ac_packed_state_t packed);
+fujitsu_ac_packed_state_t fujitsu_ac_state_expand(uint16_t compact);
+
+void fujitsu_ac_print_state(const char *prompt, fujitsu_ac_state_t *state);
+
+
+// Decoder output. Decoder writes just the packed state into buffers
+// smaller than this and returns sizeof(fujitsu_ac_packed_state_t).
+typedef struct {
+    fujitsu_ac_packed_state_t state;
+    fujitsu_ac_timer_t timer;
+    fujitsu_ac_model model;     // of the remote that sent the frame
+} fujitsu_ac_ir_result_t;
+
+
+typedef struct {
+    // encoder
+    uint32_t cache_hits;
+    uint32_t cache_misses;
+
+    // decoder
+    uint32_t frames_received;
+    uint32_t frames_decoded;
+    uint32_t frames_calibrated; // decoded only after rescaling to frame's header
+    uint32_t errors[fujitsu_ac_ir_error_count];
+    histogram_t decode_time;    // us per burst
+} fujitsu_ac_ir_stats_t;
+
+
 void fujitsu_ac_ir_tx_init(fujitsu_ac_model ac_model);
-int fujitsu_ac_ir_send(fujitsu_ac_state_t *state);
+
+// Switch model frames are encoded for, e.g. between units sharing one
+// transmitter. Cached frames of the other model are kept.
+void fujitsu_ac_ir_set_model(fujitsu_ac_model ac_model);
+fujitsu_ac_model fujitsu_ac_ir_get_model();
+
+// True for models the codec knows, e.g. to validate a persisted one
+bool fujitsu_ac_ir_model_valid(fujitsu_ac_model ac_model);
+
+int fujitsu_ac_ir_send(fujitsu_ac_packed_state_t state);
+
+// Send a full state frame that also sets (or, with ac_timer_none, stops)
+// AC's timer. Not cached, delays differ every time. Short commands carry
+// no timer and are sent as is.
+int fujitsu_ac_ir_send_timer(fujitsu_ac_packed_state_t state, const fujitsu_ac_timer_t *timer);
+
+void fujitsu_ac_ir_set_echo_window(uint32_t window);
+
+// Timing of given model's remote learned from calibrated frames, to be
+// persisted and restored on boot
+uint16_t fujitsu_ac_ir_get_timing(fujitsu_ac_model model);
+void fujitsu_ac_ir_set_timing(fujitsu_ac_model model, uint16_t scale);
+
+void fujitsu_ac_ir_get_stats(fujitsu_ac_ir_stats_t *stats);
 
 ir_decoder_t *fujitsu_ac_ir_make_decoder();
+
+// Fingerprint of both models' frames for ir_dispatch_register()
+extern const ir_protocol_t fujitsu_ac_ir_protocol;
@@ -0,0 +1,21 @@
+#include <stdio.h>
+
+#include "histogram.h"
+
+
+void histogram_print(const char *name, const histogram_t *histogram) {
+    printf("%s: n=%u avg=%u max=%u |", name, histogram->count,
+           histogram->count ? histogram->sum / histogram->count : 0, histogram->max);
+
+    for (int i=0; i < HISTOGRAM_BUCKETS; i++) {
+        if (!histogram->buckets[i])
+            continue;
+
+        if (i == HISTOGRAM_BUCKETS - 1) {
+            printf(" >=%u:%u", 1u << (i - 1), histogram->buckets[i]);
+        } else {
+            printf(" <%u:%u", 1u << i, histogram->buckets[i]);
+        }
+    }
+    printf("\n");
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+
+// Power-of-two buckets: bucket 0 counts zeros, bucket i counts values
+// in [2^(i-1), 2^i), last bucket also everything above
+#define HISTOGRAM_BUCKETS 20
+
+typedef struct {
+    uint32_t count;
+    uint32_t sum;
+    uint32_t max;
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+
+static inline void histogram_add(histogram_t *histogram, uint32_t value) {
+    int bucket = value ? 32 - __builtin_clz(value) : 0;
+    if (bucket >= HISTOGRAM_BUCKETS)
+        bucket = HISTOGRAM_BUCKETS - 1;
+
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+
+// Print non-empty buckets on one line, e.g.
+//   decode us: n=12 avg=85 max=160 | <128:9 <256:3
+void histogram_print(const char *name, const histogram_t *histogram);
@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <FreeRTOS.h>
+#include <task.h>
+#include <espressif/esp_system.h>
+
+#include "ir_capture.h"
+#include "arena.h"
+
+
+static int varint_put(uint8_t *buffer, size_t buffer_size, uint32_t value) {
+    size_t len = 0;
+    do {
+        if (len >= buffer_size)
+            return -1;
+
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        buffer[len++] = byte | (value ? 0x80 : 0);
+    } while (value);
+
+    return len;
+}
+
+static int varint_get(const uint8_t *buffer, size_t buffer_size, uint32_t *value) {
+    uint32_t result = 0;
+    for (size_t len = 0; len < buffer_size && len < 5; len++) {
+        result |= (uint32_t)(buffer[len] & 0x7f) << (7 * len);
+        if (!(buffer[len] & 0x80)) {
+            *value = result;
+            return len + 1;
+        }
+    }
+
+    return -1;
+}
+
+static inline uint32_t zigzag_encode(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static inline int32_t zigzag_decode(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+
+int ir_capture_encode(uint8_t *buffer, size_t buffer_size, uint32_t delay,
+                      const int16_t *pulses, uint16_t pulse_count) {
+    size_t pos = 0;
+    int len;
+
+    if ((len = varint_put(buffer + pos, buffer_size - pos, delay)) < 0)
+        return -1;
+    pos += len;
+
+    if ((len = varint_put(buffer + pos, buffer_size - pos, pulse_count)) < 0)
+        return -1;
+    pos += len;
+
+    for (int i=0; i < pulse_count; i++) {
+        int32_t delta = pulses[i] - ((i >= 2) ? pulses[i-2] : 0);
+        if ((len = varint_put(buffer + pos, buffer_size - pos, zigzag_encode(delta))) < 0)
+            return -1;
+        pos += len;
+    }
+
+    return pos;
+}
+
+int ir_capture_decode(const uint8_t *buffer, size_t buffer_size, uint32_t *delay,
+                      int16_t *pulses, uint16_t max_pulses, uint16_t *pulse_count) {
+    if (!buffer_size)
+        return 0;
+
+    size_t pos = 0;
+    int len;
+    uint32_t value;
+
+    if ((len = varint_get(buffer + pos, buffer_size - pos, &value)) < 0)
+        return -1;
+    pos += len;
+    *delay = value;
+
+    if ((len = varint_get(buffer + pos, buffer_size - pos, &value)) < 0)
+        return -1;
+    pos += len;
+    if (value > max_pulses)
+        return -1;
+    *pulse_count = value;
+
+    for (int i=0; i < *pulse_count; i++) {
+        if ((len = varint_get(buffer + pos, buffer_size - pos, &value)) < 0)
+            return -1;
+        pos += len;
+
+        int32_t pulse = zigzag_decode(value) + ((i >= 2) ? pulses[i-2] : 0);
+        if (pulse < INT16_MIN || pulse > INT16_MAX)
+            return -1;
+        pulses[i] = pulse;
+    }
+
+    return pos;
+}
+
+
+#if IR_CAPTURE_SIZE > 0
+
+static uint8_t capture_buffer[IR_CAPTURE_SIZE];
+static uint32_t capture_used = 0;
+static uint32_t capture_dropped = 0;
+static uint32_t capture_time;
+static bool capture_started = false;
+static volatile bool capture_enabled = false;
+
+
+typedef struct {
+    ir_decoder_t decoder;
+    ir_decoder_t *next;
+} ir_capture_decoder_t;
+
+
+static int ir_capture_decoder_decode(ir_capture_decoder_t *decoder,
+                                     int16_t *pulses, uint16_t pulse_count,
+                                     void *decode_buffer, uint16_t decode_buffer_size)
+{
+    if (capture_enabled) {
+        // Only the receiver task gets here, so one scratch record will do.
+        // Encoding takes a while, so it is done with interrupts on and
+        // just copied in next to dump.
+        static uint8_t record[IR_CAPTURE_RECORD_SIZE(IR_CAPTURE_MAX_PULSES)];
+
+        uint32_t now = sdk_system_get_time();
+        int size = ir_capture_encode(record, sizeof(record),
+                                     capture_started ? now - capture_time : 0,
+                                     pulses, pulse_count);
+
+        taskENTER_CRITICAL();
+        if (size < 0 || (uint32_t)size > sizeof(capture_buffer) - capture_used) {
+            capture_dropped++;
+        } else {
+            memcpy(capture_buffer + capture_used, record, size);
+            capture_used += size;
+        }
+        taskEXIT_CRITICAL();
+
+        capture_time = now;
+        capture_started = true;
+    }
+
+    return decoder->next->decode(decoder->next, pulses, pulse_count,
+                                 decode_buffer, decode_buffer_size);
+}
+
+static void ir_capture_decoder_free(ir_capture_decoder_t *decoder) {
+    decoder->next->free(decoder->next);
+    arena_free(&decoder_arena, decoder);
+}
+
+ir_decoder_t *ir_capture_make_decoder(ir_decoder_t *next) {
+    ir_capture_decoder_t *decoder = arena_alloc(&decoder_arena, sizeof(ir_capture_decoder_t));
+    if (!decoder)
+        return next;
+
+    decoder->decoder.decode = (ir_decoder_decode_t) ir_capture_decoder_decode;
+    decoder->decoder.free = (ir_decoder_free_t) ir_capture_decoder_free;
+    decoder->next = next;
+
+    return (ir_decoder_t*) decoder;
+}
+
+void ir_capture_enable(bool enable) {
+    capture_enabled = enable;
+}
+
+bool ir_capture_enabled() {
+    return capture_enabled;
+}
+
+void ir_capture_dump() {
+    taskENTER_CRITICAL();
+    uint32_t end = capture_used;
+    uint32_t dropped = capture_dropped;
+    capture_dropped = 0;
+    taskEXIT_CRITICAL();
+
+    // Receiver only appends, so everything before end is stable
+    printf("CAPTURE BEGIN %u %u\n", end, dropped);
+    for (uint32_t pos=0; pos < end; pos += 32) {
+        printf("CAPTURE ");
+        for (uint32_t i=pos; i < end && i < pos + 32; i++)
+            printf("%02x", capture_buffer[i]);
+        printf("\n");
+    }
+    printf("CAPTURE END\n");
+
+    taskENTER_CRITICAL();
+    memmove(capture_buffer, capture_buffer + end, capture_used - end);
+    capture_used -= end;
+    taskEXIT_CRITICAL();
+}
+
+#else
+
+ir_decoder_t *ir_capture_make_decoder(ir_decoder_t *decoder) {
+    return decoder;
+}
+
+void ir_capture_enable(bool enable) {
+}
+
+bool ir_capture_enabled() {
+    return false;
+}
+
+void ir_capture_dump() {
+    printf("IR capture is disabled, build with IR_CAPTURE_SIZE > 0\n");
+}
+
+#endif
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <ir/ir.h>
+
+
+// Bytes of RAM to record received raw bursts into, 0 disables capturing
+#ifndef IR_CAPTURE_SIZE
+#define IR_CAPTURE_SIZE 0
+#endif
+
+// Longer bursts are counted as dropped
+#ifndef IR_CAPTURE_MAX_PULSES
+#define IR_CAPTURE_MAX_PULSES 300
+#endif
+
+// Capture format. Files start with IR_CAPTURE_MAGIC, followed by one record
+// per burst:
+//   varint  us since previous burst (0 for the first one)
+//   varint  pulse count
+//   varint  zigzag(pulse[i] - pulse[i-2]) for every pulse
+// Deltas are taken against the previous pulse of the same polarity, so
+// marks and spaces of a steady remote encode to a byte each.
+#define IR_CAPTURE_MAGIC "IRC1"
+#define IR_CAPTURE_MAGIC_SIZE 4
+
+// Largest encoded record for given number of pulses
+#define IR_CAPTURE_RECORD_SIZE(pulse_count) (10 + 3 * (pulse_count))
+
+
+// Encode one burst into buffer. Returns number of bytes written or -1 if
+// buffer is too small.
+int ir_capture_encode(uint8_t *buffer, size_t buffer_size, uint32_t delay,
+                      const int16_t *pulses, uint16_t pulse_count);
+
+// Decode one record from buffer. Returns number of bytes consumed, 0 if
+// buffer is empty, -1 if record is corrupted or has more than max_pulses
+// pulses.
+int ir_capture_decode(const uint8_t *buffer, size_t buffer_size, uint32_t *delay,
+                      int16_t *pulses, uint16_t max_pulses, uint16_t *pulse_count);
+
+
+// Wrap decoder so that every burst it gets is recorded (while capturing is
+// enabled) before being passed on. Returns decoder itself if capturing is
+// compiled out.
+ir_decoder_t *ir_capture_make_decoder(ir_decoder_t *decoder);
+
+void ir_capture_enable(bool enable);
+bool ir_capture_enabled();
+
+// Print recorded bursts over serial as hex lines between "CAPTURE BEGIN"
+// and "CAPTURE END" and free the space. Replay with host/build/irreplay.
+void ir_capture_dump();
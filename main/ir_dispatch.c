@@ -0,0 +1,99 @@
+#include <stdlib.h>
+
+#include "ir_dispatch.h"
+#include "arena.h"
+
+
+typedef struct {
+    ir_protocol_t protocol;
+    ir_decoder_t *decoder;
+
+    // precomputed header ranges
+    int16_t mark_min, mark_max;
+    int16_t space_min, space_max;
+} ir_dispatch_entry_t;
+
+
+static ir_dispatch_entry_t registry[IR_DISPATCH_MAX_PROTOCOLS];
+static uint8_t registry_size = 0;
+static ir_dispatch_stats_t stats;
+
+
+int ir_dispatch_register(const ir_protocol_t *protocol, ir_decoder_t *decoder) {
+    if (registry_size >= IR_DISPATCH_MAX_PROTOCOLS || !decoder)
+        return -1;
+
+    ir_dispatch_entry_t *entry = &registry[registry_size];
+    entry->protocol = *protocol;
+    entry->decoder = decoder;
+
+    int16_t delta = abs(protocol->header_mark) * protocol->tolerance / 100;
+    entry->mark_min = protocol->header_mark - delta;
+    entry->mark_max = protocol->header_mark + delta;
+
+    delta = abs(protocol->header_space) * protocol->tolerance / 100;
+    entry->space_min = protocol->header_space - delta;
+    entry->space_max = protocol->header_space + delta;
+
+    return registry_size++;
+}
+
+const char *ir_dispatch_protocol_name(uint8_t protocol) {
+    if (protocol >= registry_size)
+        return "unknown";
+
+    return registry[protocol].protocol.name;
+}
+
+int ir_dispatch_protocol_count() {
+    return registry_size;
+}
+
+void ir_dispatch_get_stats(ir_dispatch_stats_t *result) {
+    *result = stats;
+}
+
+
+static int ir_dispatch_decode(ir_decoder_t *decoder, int16_t *pulses, uint16_t pulse_count,
+                              void *decode_buffer, uint16_t decode_buffer_size)
+{
+    if (decode_buffer_size < sizeof(ir_dispatch_result_t))
+        return -1;
+
+    ir_dispatch_result_t *result = decode_buffer;
+    result->protocol = IR_DISPATCH_UNKNOWN;
+
+    if (pulse_count >= 2) {
+        for (int i=0; i < registry_size; i++) {
+            ir_dispatch_entry_t *entry = &registry[i];
+            if (pulse_count < entry->protocol.min_pulses ||
+                    pulse_count > entry->protocol.max_pulses ||
+                    pulses[0] < entry->mark_min || pulses[0] > entry->mark_max ||
+                    pulses[1] < entry->space_min || pulses[1] > entry->space_max)
+                continue;
+
+            stats.hits[i]++;
+            result->protocol = i;
+            return entry->decoder->decode(entry->decoder, pulses, pulse_count, result->data,
+                                          decode_buffer_size - sizeof(ir_dispatch_result_t));
+        }
+    }
+
+    stats.unknown++;
+    return -1;
+}
+
+static void ir_dispatch_free(ir_decoder_t *decoder) {
+    arena_free(&decoder_arena, decoder);
+}
+
+ir_decoder_t *ir_dispatch_make_decoder() {
+    ir_decoder_t *decoder = arena_alloc(&decoder_arena, sizeof(ir_decoder_t));
+    if (!decoder)
+        return NULL;
+
+    decoder->decode = ir_dispatch_decode;
+    decoder->free = ir_dispatch_free;
+
+    return decoder;
+}
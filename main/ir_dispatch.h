@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <ir/ir.h>
+
+
+#ifndef IR_DISPATCH_MAX_PROTOCOLS
+#define IR_DISPATCH_MAX_PROTOCOLS 4
+#endif
+
+// Protocol fingerprint: bursts are classified by header timing and
+// pulse count only, no bits are decoded until a protocol matches
+typedef struct {
+    const char *name;
+
+    int16_t header_mark;
+    int16_t header_space;
+    uint8_t tolerance;      // percent, for header mark and space
+
+    uint16_t min_pulses;
+    uint16_t max_pulses;
+} ir_protocol_t;
+
+// ir_dispatch_result_t.protocol of a burst that matched no protocol
+#define IR_DISPATCH_UNKNOWN 0xff
+
+// Decode buffer layout of the dispatching decoder: id of the matched
+// protocol followed by its decoder's output. Decoder returns the matched
+// decoder's result, -1 for unknown bursts.
+typedef struct {
+    uint8_t protocol;
+    uint8_t data[] __attribute__((aligned(4)));
+} ir_dispatch_result_t;
+
+#define IR_DISPATCH_RESULT_SIZE(data_size) (sizeof(ir_dispatch_result_t) + (data_size))
+
+
+typedef struct {
+    uint32_t unknown;
+    uint32_t hits[IR_DISPATCH_MAX_PROTOCOLS];
+} ir_dispatch_stats_t;
+
+
+// Add protocol to the registry. Returns protocol id or -1 if registry is
+// full. Fingerprints should not overlap, first match wins.
+int ir_dispatch_register(const ir_protocol_t *protocol, ir_decoder_t *decoder);
+
+const char *ir_dispatch_protocol_name(uint8_t protocol);
+int ir_dispatch_protocol_count();
+
+void ir_dispatch_get_stats(ir_dispatch_stats_t *stats);
+
+// Decoder classifying bursts and passing them to registered decoders.
+// Registered decoders are not owned by it.
+ir_decoder_t *ir_dispatch_make_decoder();
@@ -1,4 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
 #include <espressif/esp_wifi.h>
 #include <espressif/esp_sta.h>
 #include <espressif/esp_common.h>
@@ -6,7 +9,6 @@
 #include <esp8266.h>
 #include <FreeRTOS.h>
 #include <task.h>
-#include <event_groups.h>
 
 #include <etstimer.h>
 #include <esplibs/libmain.h>
@@ -16,8 +18,20 @@
 #include <wifi_config.h>
 
 #include <dht/dht.h>
+#include <ir/generic.h>
+#include <sysparam.h>
 
 #include "fujitsu_ac_ir.h"
+#include "ac_inbox.h"
+#include "ac_schedule.h"
+#include "trace.h"
+#include "histogram.h"
+#include "ir_capture.h"
+#include "ir_dispatch.h"
+#include "arena.h"
+#include "task_monitor.h"
+#include "thermostat_control.h"
+#include "sensor_ring.h"
 
 
 #define TEMPERATURE_POLL_PERIOD 10000
@@ -25,14 +39,149 @@
 #define LED_GPIO 2
 #define IR_RX_GPIO 5
 
+// How long (ms) IR TX task waits after the first state change before sending,
+// so that multi-characteristic writes (e.g. scenes) go out as a single frame
+#ifndef AC_TX_COALESCE_WINDOW
+#define AC_TX_COALESCE_WINDOW 100
+#endif
+
+// Period (s) after which current state is sent again even if unchanged,
+// in case AC missed a frame; 0 disables
+#ifndef AC_TX_REFRESH_PERIOD
+#define AC_TX_REFRESH_PERIOD 0
+#endif
+
+// Indoor units driven by this controller (up to 4), each with its own
+// thermostat and fan services. Fujitsu frames carry no unit address, so
+// with more than one unit every unit's IR LED is switched on by its own
+// GPIO, see AC_UNIT_CONFIGS.
+#ifndef AC_UNITS
+#define AC_UNITS 1
+#endif
+
+// Time (ms) kept between bursts to different units, so that no receiver
+// takes two of them for one
+#ifndef AC_TX_UNIT_GAP
+#define AC_TX_UNIT_GAP 100
+#endif
+
+// Remote frames of a model no unit is set to, received this many times in
+// a row, switch units to that model (persisted); 0 disables
+#ifndef AC_MODEL_DETECT_FRAMES
+#define AC_MODEL_DETECT_FRAMES 2
+#endif
+
+// Let Wifi modem sleep between beacons, AC timer takes care of schedules
+#ifndef WIFI_MODEM_SLEEP
+#define WIFI_MODEM_SLEEP 0
+#endif
+
+// DHT is bit-banged with interrupts off, which stretches pulses of an IR
+// burst being received or sent at the same time. Sensor reads wait until
+// IR has been quiet for SENSOR_IR_HOLDOFF ms, checking again every
+// SENSOR_RETRY_DELAY ms, but no more than SENSOR_MAX_DEFERS times.
+#ifndef SENSOR_IR_HOLDOFF
+#define SENSOR_IR_HOLDOFF 300
+#endif
+#define SENSOR_RETRY_DELAY 100
+#define SENSOR_MAX_DEFERS 50
+
+// Median filtered readings go to HomeKit only once they move this far from
+// the value last sent
+#ifndef SENSOR_TEMPERATURE_DELTA
+#define SENSOR_TEMPERATURE_DELTA 0.5
+#endif
+#ifndef SENSOR_HUMIDITY_DELTA
+#define SENSOR_HUMIDITY_DELTA 2.0
+#endif
+
+// Failed sensor reads are retried this many times before the next poll,
+// DHT11 needs a second between reads
+#define SENSOR_READ_RETRIES 2
+#define SENSOR_READ_RETRY_DELAY 2000
+
+
+// Task stack depths, in words. 's' on the serial console prints the
+// deepest use seen and recommended sizes to override these with.
+#ifndef AC_TASK_STACK_SIZE
+#define AC_TASK_STACK_SIZE 512
+#endif
+#ifndef THERMOSTAT_TASK_STACK_SIZE
+#define THERMOSTAT_TASK_STACK_SIZE 256
+#endif
+#ifndef IR_RX_TASK_STACK_SIZE
+#define IR_RX_TASK_STACK_SIZE 1024
+#endif
+#ifndef CONSOLE_TASK_STACK_SIZE
+#define CONSOLE_TASK_STACK_SIZE 512
+#endif
+#ifndef RESET_TASK_STACK_SIZE
+#define RESET_TASK_STACK_SIZE 256
+#endif
+#ifndef IDENTIFY_TASK_STACK_SIZE
+#define IDENTIFY_TASK_STACK_SIZE 128
+#endif
+
+#define STATIC_TASK_COUNT 5
+#define STACK_ARENA_SIZE \
+    ((AC_TASK_STACK_SIZE + THERMOSTAT_TASK_STACK_SIZE + IR_RX_TASK_STACK_SIZE + \
+      CONSOLE_TASK_STACK_SIZE + RESET_TASK_STACK_SIZE) * sizeof(StackType_t) + \
+     STATIC_TASK_COUNT * ((sizeof(StaticTask_t) + 7) & ~7))
+
+// "Fujitsu AC-XXXXXX"
+#define NAME_ARENA_SIZE 24
+
 
 #define MIN(a, b) (((a) <= (b)) ? (a) : (b))
 #define MAX(a, b) (((a) >= (b)) ? (a) : (b))
+#define countof(x) (sizeof(x) / sizeof(*x))
 
 
 void thermostat_on_callback(homekit_characteristic_t *_ch, homekit_value_t on, void *context);
 
 
+ARENA_DEFINE(stack_arena, STACK_ARENA_SIZE);
+ARENA_DEFINE(name_arena, NAME_ARENA_SIZE);
+
+// Create a task that lives until reboot, with stack from stack_arena
+TaskHandle_t task_create(TaskFunction_t task, const char *name, uint16_t stack_size,
+                         UBaseType_t priority) {
+    TaskHandle_t handle = NULL;
+#if STATIC_ALLOCATION
+    StaticTask_t *tcb = arena_alloc(&stack_arena, sizeof(StaticTask_t));
+    StackType_t *stack = arena_alloc(&stack_arena, stack_size * sizeof(StackType_t));
+    if (tcb && stack)
+        handle = xTaskCreateStatic(task, name, stack_size, NULL, priority, stack, tcb);
+#else
+    xTaskCreate(task, name, stack_size, NULL, priority, &handle);
+#endif
+    task_monitor_add(handle, name, stack_size);
+    return handle;
+}
+
+#if STATIC_ALLOCATION
+static StaticTask_t idle_task_tcb;
+static StackType_t idle_task_stack[configMINIMAL_STACK_SIZE];
+
+void vApplicationGetIdleTaskMemory(StaticTask_t **tcb, StackType_t **stack, uint32_t *stack_size) {
+    *tcb = &idle_task_tcb;
+    *stack = idle_task_stack;
+    *stack_size = configMINIMAL_STACK_SIZE;
+}
+
+#if configUSE_TIMERS
+static StaticTask_t timer_task_tcb;
+static StackType_t timer_task_stack[configTIMER_TASK_STACK_DEPTH];
+
+void vApplicationGetTimerTaskMemory(StaticTask_t **tcb, StackType_t **stack, uint32_t *stack_size) {
+    *tcb = &timer_task_tcb;
+    *stack = timer_task_stack;
+    *stack_size = configTIMER_TASK_STACK_DEPTH;
+}
+#endif
+#endif
+
+
 void reset_configuration_task() {
     printf("Resetting Wifi Config\n");
 
@@ -55,7 +204,7 @@ void reset_configuration_task() {
 
 void reset_configuration() {
     printf("Resetting configuration\n");
-    xTaskCreate(reset_configuration_task, "Reset configuration", 256, NULL, 2, NULL);
+    task_create(reset_configuration_task, "Reset configuration", RESET_TASK_STACK_SIZE, 2);
 }
 
 
@@ -69,64 +218,426 @@ void led_init() {
 }
 
 
-fujitsu_ac_state_t ac_state;
+typedef struct {
+    const char *name;
+    fujitsu_ac_model model;  // until another one is detected
+    int8_t tx_gate_gpio;    // switches unit's IR LED on, -1 if it is not gated
+} ac_unit_config_t;
+
+// {name, model, TX gate GPIO} of every unit
+#ifndef AC_UNIT_CONFIGS
+#if AC_UNITS == 1
+#define AC_UNIT_CONFIGS \
+    {"Thermostat", fujitsu_ac_model_ARRAH2E, -1}
+#else
+#define AC_UNIT_CONFIGS \
+    {"Thermostat 1", fujitsu_ac_model_ARRAH2E, 4}, \
+    {"Thermostat 2", fujitsu_ac_model_ARRAH2E, 13}, \
+    {"Thermostat 3", fujitsu_ac_model_ARRAH2E, 15}, \
+    {"Thermostat 4", fujitsu_ac_model_ARRAH2E, 16}
+#endif
+#endif
+
+#if AC_UNITS < 1 || AC_UNITS > 4
+#error "AC_UNITS must be 1..4"
+#endif
+
+static const ac_unit_config_t ac_unit_configs[] = {AC_UNIT_CONFIGS};
+
+_Static_assert(countof(ac_unit_configs) >= AC_UNITS, "AC_UNIT_CONFIGS has fewer units than AC_UNITS");
+
+
+// How urgently a unit's pending work has to go out. Units are served
+// highest priority first, then longest waiting first.
+typedef enum {
+    ac_tx_priority_idle = 0,
+    ac_tx_priority_refresh,     // unchanged state resent
+    ac_tx_priority_schedule,    // control loop and scheduled events
+    ac_tx_priority_user,        // HomeKit writes and remote presses
+} ac_tx_priority_t;
+
+
+// Last known AC state and HomeKit targets, kept in sysparam (a wear
+// leveled log in flash) and rewritten only when they change, so that after
+// a reboot thermostat shows the real state without sending anything.
+// Current heating/cooling state is derived and not saved.
+#define AC_SAVED_STATE_KEY "ac_state"
+#define AC_SAVED_STATE_VERSION 1
+
+typedef struct {
+    uint8_t version;
+
+    uint8_t command;
+    uint8_t mode;
+    uint8_t fan;
+    uint8_t swing;
+    uint8_t temperature;
+    uint8_t fan_only;
+
+    uint8_t target_state;
+    uint8_t fan_active;
+    uint8_t fan_swing_mode;
+    float target_temperature;
+    float fan_rotation_speed;
+
+    uint8_t last_frame_valid;
+    fujitsu_ac_packed_state_t last_frame;
+} ac_saved_state_t;
+
+
+// Time schedules run on, ms
+static inline uint32_t schedule_now() {
+    return xTaskGetTickCount() * portTICK_PERIOD_MS;
+}
+
+
+// One indoor unit. State and characteristics are owned by AC task. HomeKit
+// callbacks, IR receiver and temperature sensor only post their inputs to
+// unit's inbox.
+typedef struct {
+    const ac_unit_config_t *config;
+    fujitsu_ac_model model;
+
+    fujitsu_ac_state_t state;
+    uint8_t fan;
+    bool restored;
+
+    ac_inbox_t inbox;
+
+    // Inputs taken by AC task but not served yet
+    ac_inbox_t inputs;
+    uint32_t pending;
+    ac_tx_priority_t priority;
+    uint32_t priority_time;
+
+    // HomeKit writes vs state updates they were coalesced into
+    uint32_t tx_requests;
+    uint32_t tx_updates;
+
+    // IR frames actually sent, updates that produced the frame AC already has,
+    // and unchanged frames resent by refresh
+    uint32_t tx_frames;
+    uint32_t tx_suppressed;
+    uint32_t tx_refreshes;
+
+    // Frame AC last acknowledged: the last one we sent or one received from
+    // its own remote
+    fujitsu_ac_packed_state_t last_frame;
+    bool last_frame_valid;
+    TickType_t last_frame_ticks;
+
+    // us: HomeKit write to IR frame sent, frame ready to burst started
+    // (bursts to other units and gap between them) and remote frame
+    // decoded to HomeKit notified
+    histogram_t homekit_latency;
+    histogram_t tx_wait;
+    histogram_t remote_latency;
+
+    // Control loop and its input: latest filtered reading posted to the
+    // unit, HomeKit only gets it past delta
+    thermostat_control_t control;
+    float temperature;
+
+    ac_schedule_t schedule;
+    uint32_t timer_frames;
+
+    ac_saved_state_t saved_state;
+    bool saved_state_valid;
+    uint32_t state_saves;
+
+    homekit_characteristic_t name;
+    homekit_characteristic_t current_temperature;
+    homekit_characteristic_t target_temperature;
+    homekit_characteristic_t units;
+    homekit_characteristic_t current_state;
+    homekit_characteristic_t target_state;
+    homekit_characteristic_t fan_active;
+    homekit_characteristic_t fan_rotation_speed;
+    homekit_characteristic_t fan_swing_mode;
+    homekit_characteristic_t timer;
+} ac_unit_t;
+
+
+TaskHandle_t ac_task_handle = NULL;
+
+// us: fujitsu_ac_ir_send() duration, for all units
+histogram_t send_time;
+
+// sdk_system_get_time() of the last IR burst received or sent
+volatile uint32_t ir_activity_time = 0;
+
+// Sensor reads done, put off because of IR (collisions avoided), done
+// anyway after SENSOR_MAX_DEFERS, and overlapped by a burst regardless
+uint32_t sensor_reads = 0;
+uint32_t sensor_defers = 0;
+uint32_t sensor_forced = 0;
+uint32_t sensor_collisions = 0;
+uint32_t sensor_failures = 0;
+
+sensor_ring_t temperature_ring;
+sensor_ring_t humidity_ring;
+
+// Filtered readings sent to HomeKit and held back as within delta
+uint32_t sensor_updates = 0;
+uint32_t sensor_updates_skipped = 0;
+
+
+void on_update(homekit_characteristic_t *ch, homekit_value_t value, void *context);
+void fan_active_set(homekit_characteristic_t *ch, homekit_value_t value);
+homekit_value_t ac_timer_get(const homekit_characteristic_t *ch);
+void ac_timer_set(homekit_characteristic_t *ch, homekit_value_t value);
+
+// Custom characteristic to schedule AC on/off through its own timer:
+// minutes until the next event, positive for turning on, negative for
+// turning off. Writing 0 cancels all events.
+#define HOMEKIT_CHARACTERISTIC_CUSTOM_AC_TIMER HOMEKIT_CUSTOM_UUID("F0000103")
+#define HOMEKIT_DECLARE_CHARACTERISTIC_CUSTOM_AC_TIMER(_value, ...) \
+    .type = HOMEKIT_CHARACTERISTIC_CUSTOM_AC_TIMER, \
+    .description = "AC timer", \
+    .format = homekit_format_int, \
+    .unit = homekit_unit_none, \
+    .permissions = homekit_permissions_paired_read | homekit_permissions_paired_write, \
+    .min_value = (float[]) {-10080}, \
+    .max_value = (float[]) {10080}, \
+    .min_step = (float[]) {1}, \
+    .value = HOMEKIT_INT_(_value), \
+    ##__VA_ARGS__
+
+// Expanded once per unit, so that every unit gets its own callbacks:
+// HomeKit server chains event subscriptions onto them
+#define AC_UNIT_INIT(i) { \
+    .config = &ac_unit_configs[i], \
+    .name = HOMEKIT_CHARACTERISTIC_(NAME, "Thermostat"), \
+    .current_temperature = HOMEKIT_CHARACTERISTIC_(CURRENT_TEMPERATURE, 0), \
+    .target_temperature = HOMEKIT_CHARACTERISTIC_( \
+        TARGET_TEMPERATURE, 22, \
+        .min_value = (float[]) {AC_MIN_TEMPERATURE}, \
+        .max_value = (float[]) {AC_MAX_TEMPERATURE}, \
+        .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(on_update, .context=(void*)ac_input_target_temperature), \
+    ), \
+    .units = HOMEKIT_CHARACTERISTIC_(TEMPERATURE_DISPLAY_UNITS, 0), \
+    .current_state = HOMEKIT_CHARACTERISTIC_(CURRENT_HEATING_COOLING_STATE, 0), \
+    .target_state = HOMEKIT_CHARACTERISTIC_( \
+        TARGET_HEATING_COOLING_STATE, 0, \
+        .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(on_update, .context=(void*)ac_input_target_state) \
+    ), \
+    .fan_active = HOMEKIT_CHARACTERISTIC_(ACTIVE, 0, .setter_ex=fan_active_set), \
+    .fan_rotation_speed = HOMEKIT_CHARACTERISTIC_( \
+        ROTATION_SPEED, 0, \
+        .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(on_update, .context=(void*)ac_input_fan_rotation_speed) \
+    ), \
+    .fan_swing_mode = HOMEKIT_CHARACTERISTIC_( \
+        SWING_MODE, 0, \
+        .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(on_update, .context=(void*)ac_input_fan_swing_mode) \
+    ), \
+    .timer = HOMEKIT_CHARACTERISTIC_(CUSTOM_AC_TIMER, 0, \
+                                     .getter_ex=ac_timer_get, \
+                                     .setter_ex=ac_timer_set), \
+}
+
+ac_unit_t ac_units[AC_UNITS] = {
+    AC_UNIT_INIT(0),
+#if AC_UNITS > 1
+    AC_UNIT_INIT(1),
+#endif
+#if AC_UNITS > 2
+    AC_UNIT_INIT(2),
+#endif
+#if AC_UNITS > 3
+    AC_UNIT_INIT(3),
+#endif
+};
+
+// Unit TX is currently set up for: its model and its LED gate
+ac_unit_t *ac_tx_unit = NULL;
+
+homekit_characteristic_t current_humidity = HOMEKIT_CHARACTERISTIC_(CURRENT_RELATIVE_HUMIDITY, 0);
+
+
+static inline int ac_unit_index(const ac_unit_t *unit) {
+    return unit - ac_units;
+}
+
+// Unit a characteristic belongs to
+ac_unit_t *ac_unit_of(const homekit_characteristic_t *ch) {
+    for (int i=0; i < AC_UNITS; i++) {
+        if ((void*)ch >= (void*)&ac_units[i] && (void*)ch < (void*)&ac_units[i + 1])
+            return &ac_units[i];
+    }
+    return &ac_units[0];
+}
+
 
-EventGroupHandle_t sync_flags;
-#define SYNC_FLAGS_UPDATE (1 << 0)
+void ac_post(ac_unit_t *unit, ac_input_t input, ac_input_value_t value) {
+    ac_inbox_post(&unit->inbox, input, &value);
 
-void update_state();
+    // Inputs posted before AC task starts are picked up when it does
+    if (ac_task_handle)
+        xTaskNotifyGive(ac_task_handle);
+}
 
 
 void on_update(homekit_characteristic_t *ch, homekit_value_t value, void *context) {
-    update_state();
+    ac_unit_t *unit = ac_unit_of(ch);
+    ac_input_t input = (ac_input_t) context;
+
+    ac_input_value_t input_value;
+    switch (input) {
+    case ac_input_target_temperature:
+    case ac_input_fan_rotation_speed:
+        input_value.float_value = value.float_value;
+        break;
+    default:
+        input_value.int_value = value.int_value;
+    }
+
+    unit->tx_requests++;
+    trace(trace_homekit_write, (ac_unit_index(unit) << 8) | input, 0);
+    ac_post(unit, input, input_value);
 }
 
+void fan_active_set(homekit_characteristic_t *ch, homekit_value_t value) {
+    ac_unit_t *unit = ac_unit_of(ch);
 
-homekit_characteristic_t current_humidity = HOMEKIT_CHARACTERISTIC_(CURRENT_RELATIVE_HUMIDITY, 0);
-homekit_characteristic_t current_temperature = HOMEKIT_CHARACTERISTIC_(CURRENT_TEMPERATURE, 0);
-homekit_characteristic_t target_temperature  = HOMEKIT_CHARACTERISTIC_(
-    TARGET_TEMPERATURE, 22,
-    .min_value = (float[]) {AC_MIN_TEMPERATURE},
-    .max_value = (float[]) {AC_MAX_TEMPERATURE},
-    .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(on_update),
-);
-homekit_characteristic_t units = HOMEKIT_CHARACTERISTIC_(TEMPERATURE_DISPLAY_UNITS, 0);
-homekit_characteristic_t current_state = HOMEKIT_CHARACTERISTIC_(CURRENT_HEATING_COOLING_STATE, 0);
-homekit_characteristic_t target_state = HOMEKIT_CHARACTERISTIC_(
-    TARGET_HEATING_COOLING_STATE, 0,
-    .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(on_update)
-);
-
-uint8_t fan = 0;
-
-void fan_active_set(homekit_value_t value) {
-    // fan = value.bool_value;
-    update_state();
-}
-
-homekit_characteristic_t fan_active = HOMEKIT_CHARACTERISTIC_(ACTIVE, 0, .setter=fan_active_set);
-homekit_characteristic_t fan_rotation_speed = HOMEKIT_CHARACTERISTIC_(
-    ROTATION_SPEED, 0,
-    .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(on_update)
-);
-homekit_characteristic_t fan_swing_mode = HOMEKIT_CHARACTERISTIC_(
-    SWING_MODE, 0,
-    .callback=HOMEKIT_CHARACTERISTIC_CALLBACK(on_update)
-);
-
-
-void update_state() {
-    if ((xEventGroupGetBits(sync_flags) & SYNC_FLAGS_UPDATE) == 0)
+    unit->tx_requests++;
+    trace(trace_homekit_write, (ac_unit_index(unit) << 8) | ac_input_fan_active, 0);
+    ac_post(unit, ac_input_fan_active, (ac_input_value_t) {.int_value = value.bool_value});
+}
+
+
+// Characteristics changed by AC task. Changes are only marked dirty while
+// a state transition is applied and notified together by notify_flush(),
+// so intermediate values never reach controllers.
+#define AC_UNIT_NOTIFY(i) \
+    &ac_units[i].current_temperature, \
+    &ac_units[i].target_temperature, \
+    &ac_units[i].current_state, \
+    &ac_units[i].target_state, \
+    &ac_units[i].fan_active, \
+    &ac_units[i].fan_rotation_speed, \
+    &ac_units[i].fan_swing_mode
+
+homekit_characteristic_t *notify_characteristics[] = {
+    AC_UNIT_NOTIFY(0),
+#if AC_UNITS > 1
+    AC_UNIT_NOTIFY(1),
+#endif
+#if AC_UNITS > 2
+    AC_UNIT_NOTIFY(2),
+#endif
+#if AC_UNITS > 3
+    AC_UNIT_NOTIFY(3),
+#endif
+};
+
+uint32_t notify_dirty = 0;
+homekit_value_t notify_initial_values[countof(notify_characteristics)];
+
+// Value changes vs events actually sent; the difference was collapsed
+uint32_t notify_changes = 0;
+uint32_t notify_events = 0;
+
+
+void characteristic_set(homekit_characteristic_t *ch, homekit_value_t value) {
+    if (homekit_value_equal(&value, &ch->value))
         return;
 
+    for (int i=0; i < countof(notify_characteristics); i++) {
+        if (notify_characteristics[i] != ch)
+            continue;
+
+        if (!(notify_dirty & (1 << i))) {
+            notify_dirty |= (1 << i);
+            notify_initial_values[i] = ch->value;
+        }
+        break;
+    }
+
+    ch->value = value;
+    notify_changes++;
+}
+
+
+void notify_flush() {
+    if (!notify_dirty)
+        return;
+
+    for (int i=0; i < countof(notify_characteristics); i++) {
+        if (!(notify_dirty & (1 << i)))
+            continue;
+
+        homekit_characteristic_t *ch = notify_characteristics[i];
+        // Changed and then changed back: nothing to tell
+        if (homekit_value_equal(&ch->value, &notify_initial_values[i]))
+            continue;
+
+        homekit_characteristic_notify(ch, ch->value);
+        notify_events++;
+    }
+
+    trace(trace_notify_flush, notify_dirty, 0);
+    notify_dirty = 0;
+}
+
+
+static void ac_set_last_frame(ac_unit_t *unit, fujitsu_ac_packed_state_t frame) {
+    // louver steps are actions, not state
+    uint8_t command = frame >> 24;
+    if (command == ac_cmd_step_horiz || command == ac_cmd_step_vert)
+        return;
+
+    unit->last_frame = frame;
+    unit->last_frame_valid = true;
+    unit->last_frame_ticks = xTaskGetTickCount();
+}
+
+
+// Point transmitter at unit: its model, and only its LED if they are gated
+static void ac_tx_select(ac_unit_t *unit) {
+    for (int i=0; i < AC_UNITS; i++) {
+        if (ac_units[i].config->tx_gate_gpio >= 0)
+            gpio_write(ac_units[i].config->tx_gate_gpio, &ac_units[i] == unit);
+    }
+
+    fujitsu_ac_ir_set_model(unit->model);
+    ac_tx_unit = unit;
+}
+
+// Frames of all units go out from AC task only, one burst at a time.
+// Switching to another unit first waits out AC_TX_UNIT_GAP since the last
+// burst on air.
+int ac_ir_send(ac_unit_t *unit, fujitsu_ac_packed_state_t state, const fujitsu_ac_timer_t *timer) {
+    uint32_t ready = sdk_system_get_time();
+    if (unit != ac_tx_unit) {
+        int32_t gap = AC_TX_UNIT_GAP * 1000 - (int32_t)(ready - ir_activity_time);
+        if (ac_tx_unit && gap > 0)
+            vTaskDelay((gap + 999) / 1000 / portTICK_PERIOD_MS + 1);
+        ac_tx_select(unit);
+    }
+
+    uint32_t send_start = sdk_system_get_time();
+    histogram_add(&unit->tx_wait, send_start - ready);
+
+    ir_activity_time = send_start;
+    int result = timer ? fujitsu_ac_ir_send_timer(state, timer) : fujitsu_ac_ir_send(state);
+    ir_activity_time = sdk_system_get_time();
+    histogram_add(&send_time, ir_activity_time - send_start);
+
+    return result;
+}
+
+
+// Derive AC state from thermostat characteristics and send it, unless AC
+// already has exactly this frame and refresh is not forced
+void ac_update_state(ac_unit_t *unit, bool refresh) {
     homekit_value_t new_current_state,
                     new_fan_active = HOMEKIT_UINT8(1),
-                    new_rotation_speed = fan_rotation_speed.value;
+                    new_rotation_speed = unit->fan_rotation_speed.value;
 
-    fujitsu_ac_state_t new_ac_state = ac_state;
+    fujitsu_ac_state_t new_ac_state = unit->state;
     new_ac_state.command = ac_cmd_turn_on;
 
-    switch (target_state.value.int_value) {
+    switch (unit->target_state.value.int_value) {
         case HOMEKIT_TARGET_HEATING_COOLING_STATE_HEAT:
             new_ac_state.mode = ac_mode_heat;
             new_current_state = HOMEKIT_UINT8(HOMEKIT_CURRENT_HEATING_COOLING_STATE_HEAT);
@@ -138,8 +649,26 @@ void update_state() {
             break;
 
         case HOMEKIT_TARGET_HEATING_COOLING_STATE_AUTO:
+            if (THERMOSTAT_CONTROL && unit->control.valid) {
+                switch (unit->control.mode) {
+                case thermostat_mode_heat:
+                    new_ac_state.mode = ac_mode_heat;
+                    new_current_state = HOMEKIT_UINT8(HOMEKIT_CURRENT_HEATING_COOLING_STATE_HEAT);
+                    break;
+                case thermostat_mode_cool:
+                    new_ac_state.mode = ac_mode_cool;
+                    new_current_state = HOMEKIT_UINT8(HOMEKIT_CURRENT_HEATING_COOLING_STATE_COOL);
+                    break;
+                default:
+                    new_ac_state.mode = ac_mode_fan;
+                    new_current_state = HOMEKIT_UINT8(HOMEKIT_CURRENT_HEATING_COOLING_STATE_OFF);
+                    break;
+                }
+                break;
+            }
+
             new_ac_state.mode = ac_mode_auto;
-            if (current_temperature.value.int_value < target_temperature.value.int_value) {
+            if (unit->current_temperature.value.int_value < unit->target_temperature.value.int_value) {
                 new_current_state = HOMEKIT_UINT8(HOMEKIT_CURRENT_HEATING_COOLING_STATE_HEAT);
             } else {
                 new_current_state = HOMEKIT_UINT8(HOMEKIT_CURRENT_HEATING_COOLING_STATE_COOL);
@@ -147,7 +676,7 @@ void update_state() {
             break;
 
         case HOMEKIT_TARGET_HEATING_COOLING_STATE_OFF:
-            if (fan) {
+            if (unit->fan) {
                 new_ac_state.mode = ac_mode_fan;
                 new_current_state = HOMEKIT_UINT8(HOMEKIT_CURRENT_HEATING_COOLING_STATE_OFF);
                 break;
@@ -160,14 +689,14 @@ void update_state() {
             new_fan_active = HOMEKIT_UINT8(0);
     }
 
-    if (ac_state.command == ac_cmd_turn_off &&
+    if (unit->state.command == ac_cmd_turn_off &&
             new_ac_state.command != ac_cmd_turn_off &&
             new_ac_state.mode != ac_mode_fan)
     {
         new_ac_state.fan = ac_fan_auto;
         new_rotation_speed = HOMEKIT_FLOAT(100);
     } else {
-        uint8_t rotation_speed = (uint8_t)fan_rotation_speed.value.float_value;
+        uint8_t rotation_speed = (uint8_t)unit->fan_rotation_speed.value.float_value;
         if (rotation_speed > 99) {
             new_ac_state.fan = ac_fan_auto;
         } else if (rotation_speed > 75) {
@@ -181,66 +710,698 @@ void update_state() {
         }
     }
 
-    new_ac_state.temperature = MIN(AC_MAX_TEMPERATURE, MAX(AC_MIN_TEMPERATURE, target_temperature.value.float_value));
-    new_ac_state.swing = fan_swing_mode.value.int_value ? ac_swing_vert : ac_swing_off;
+    new_ac_state.temperature = MIN(AC_MAX_TEMPERATURE, MAX(AC_MIN_TEMPERATURE, unit->target_temperature.value.float_value));
+    new_ac_state.swing = unit->fan_swing_mode.value.int_value ? ac_swing_vert : ac_swing_off;
+
+    fujitsu_ac_packed_state_t packed_state = fujitsu_ac_state_pack(&new_ac_state);
+    if (!refresh && unit->last_frame_valid &&
+            fujitsu_ac_state_same(unit->last_frame, packed_state)) {
+        unit->tx_suppressed++;
+        trace(trace_ir_send_suppressed, fujitsu_ac_state_compact(packed_state), 0);
+    } else {
+        unit->tx_frames++;
+
+        // A full state frame without timer would stop the armed one
+        fujitsu_ac_timer_t timer = ac_schedule_timer(&unit->schedule, schedule_now());
+        bool with_timer = unit->schedule.timer_armed && !(packed_state >> 24) &&
+            timer.type != ac_timer_none;
+
+        int result = ac_ir_send(unit, packed_state, with_timer ? &timer : NULL);
+        if (result < 0) {
+            trace(trace_ir_send_failed, fujitsu_ac_state_compact(packed_state), result);
+            return;
+        }
+
+        ac_set_last_frame(unit, packed_state);
+        ac_schedule_frame(&unit->schedule, packed_state, with_timer ? &timer : NULL);
+    }
+
+    unit->state = new_ac_state;
+
+    characteristic_set(&unit->current_state, new_current_state);
+    characteristic_set(&unit->fan_active, new_fan_active);
+    characteristic_set(&unit->fan_rotation_speed, new_rotation_speed);
+}
+
+
+// Reflect state received from IR remote in thermostat characteristics
+void ac_apply_remote_state(ac_unit_t *unit, fujitsu_ac_packed_state_t packed_state) {
+    trace(trace_remote_state, fujitsu_ac_state_compact(packed_state), 0);
+    ac_set_last_frame(unit, packed_state);
+    ac_schedule_frame(&unit->schedule, packed_state, NULL);
+
+    fujitsu_ac_state_t unpacked_state;
+    fujitsu_ac_state_unpack(packed_state, &unpacked_state);
+    fujitsu_ac_state_t *state = &unpacked_state;
+
+    homekit_value_t new_target_state, new_fan_active;
+    if (state->command == ac_cmd_turn_off) {
+        unit->fan = 0;
+        unit->state.command = state->command;
+        new_target_state = HOMEKIT_UINT8(0);
+        new_fan_active = HOMEKIT_UINT8(0);
+    } else if (state->command == ac_cmd_turn_on || state->command == ac_cmd_stay_on) {
+        unit->fan = 0;
+        unit->state = *state;
+        switch (state->mode) {
+        case ac_mode_heat:
+            new_target_state = HOMEKIT_UINT8(1);
+            break;
+        case ac_mode_cool:
+            new_target_state = HOMEKIT_UINT8(2);
+            break;
+        case ac_mode_auto:
+            new_target_state = HOMEKIT_UINT8(3);
+            break;
+        case ac_mode_dry:
+        case ac_mode_fan:
+        default:
+            new_target_state = HOMEKIT_UINT8(0);
+            break;
+        }
+
+        new_fan_active = HOMEKIT_UINT8(1);
+
+        homekit_value_t new_fan_rotation_speed;
+        switch (state->fan) {
+        case ac_fan_auto:
+        case ac_fan_high:
+        default:
+            new_fan_rotation_speed = HOMEKIT_FLOAT(100);
+            break;
+        case ac_fan_med:
+            new_fan_rotation_speed = HOMEKIT_FLOAT(75);
+            break;
+        case ac_fan_low:
+            new_fan_rotation_speed = HOMEKIT_FLOAT(45);
+            break;
+        case ac_fan_quiet:
+            new_fan_rotation_speed = HOMEKIT_FLOAT(15);
+            break;
+        }
+
+        characteristic_set(&unit->target_temperature, HOMEKIT_FLOAT(state->temperature));
+        characteristic_set(&unit->fan_rotation_speed, new_fan_rotation_speed);
+        characteristic_set(&unit->fan_swing_mode, HOMEKIT_UINT8((state->swing == ac_swing_off) ? 0 : 1));
+    } else {
+        // louver step commands do not change state
+        return;
+    }
+
+    characteristic_set(&unit->target_state, new_target_state);
+    characteristic_set(&unit->fan_active, new_fan_active);
+}
+
+
+// Run local control loop in AUTO mode on a new reading or target. Returns
+// true if AC has to be switched to another mode.
+bool ac_control_update(ac_unit_t *unit, bool reading) {
+    if (!THERMOSTAT_CONTROL ||
+            unit->target_state.value.int_value != HOMEKIT_TARGET_HEATING_COOLING_STATE_AUTO ||
+            (!reading && !unit->control.valid))
+        return false;
+
+    bool changed = thermostat_control_update(
+        &unit->control,
+        unit->temperature, unit->target_temperature.value.float_value,
+        xTaskGetTickCount() * portTICK_PERIOD_MS
+    );
+    if (changed)
+        printf("Thermostat control %d: %s\n", ac_unit_index(unit),
+               thermostat_mode_string(unit->control.mode));
+
+    return changed;
+}
+
+// Takes every filtered reading, but updates HomeKit only past delta
+void ac_apply_current_temperature(ac_unit_t *unit, float temperature) {
+    unit->temperature = temperature;
+    if (fabsf(temperature - unit->current_temperature.value.float_value) < SENSOR_TEMPERATURE_DELTA)
+        return;
+
+    characteristic_set(&unit->current_temperature, HOMEKIT_FLOAT(temperature));
+
+    if (THERMOSTAT_CONTROL)
+        return;
+
+    // If in AUTO mode, update current real mode based on temperature
+    if (unit->target_state.value.int_value == HOMEKIT_TARGET_HEATING_COOLING_STATE_AUTO) {
+        if (unit->current_temperature.value.int_value < unit->target_temperature.value.int_value) {
+            characteristic_set(&unit->current_state, HOMEKIT_UINT8(HOMEKIT_CURRENT_HEATING_COOLING_STATE_HEAT));
+        } else {
+            characteristic_set(&unit->current_state, HOMEKIT_UINT8(HOMEKIT_CURRENT_HEATING_COOLING_STATE_COOL));
+        }
+    }
+}
+
+
+// Re-apply a HomeKit write, in case a remote state received meanwhile
+// has overwritten the characteristic
+void ac_apply_homekit_input(ac_unit_t *unit, ac_input_t input, ac_input_value_t *value) {
+    switch (input) {
+    case ac_input_target_state:
+        characteristic_set(&unit->target_state, HOMEKIT_UINT8(value->int_value));
+        break;
+    case ac_input_target_temperature:
+        characteristic_set(&unit->target_temperature, HOMEKIT_FLOAT(value->float_value));
+        break;
+    case ac_input_fan_rotation_speed:
+        characteristic_set(&unit->fan_rotation_speed, HOMEKIT_FLOAT(value->float_value));
+        break;
+    case ac_input_fan_swing_mode:
+        characteristic_set(&unit->fan_swing_mode, HOMEKIT_UINT8(value->int_value));
+        break;
+    default:
+        break;
+    }
+}
+
+
+uint32_t ac_state_saves = 0;
+
+
+// Sysparam key of a unit. First unit keeps the keys it had before there
+// were more.
+static void ac_unit_key(ac_unit_t *unit, const char *name, char *key, size_t key_size) {
+    int index = ac_unit_index(unit);
+    if (index) {
+        snprintf(key, key_size, "%s_%d", name, index);
+    } else {
+        snprintf(key, key_size, "%s", name);
+    }
+}
+
+static void ac_saved_state_fill(ac_unit_t *unit, ac_saved_state_t *saved) {
+    // zero padding too, snapshots are compared with memcmp
+    memset(saved, 0, sizeof(*saved));
+
+    saved->version = AC_SAVED_STATE_VERSION;
+    saved->command = unit->state.command;
+    saved->mode = unit->state.mode;
+    saved->fan = unit->state.fan;
+    saved->swing = unit->state.swing;
+    saved->temperature = unit->state.temperature;
+    saved->fan_only = unit->fan;
+
+    saved->target_state = unit->target_state.value.int_value;
+    saved->fan_active = unit->fan_active.value.int_value;
+    saved->fan_swing_mode = unit->fan_swing_mode.value.int_value;
+    saved->target_temperature = unit->target_temperature.value.float_value;
+    saved->fan_rotation_speed = unit->fan_rotation_speed.value.float_value;
+
+    saved->last_frame_valid = unit->last_frame_valid;
+    saved->last_frame = unit->last_frame;
+}
+
+void ac_state_save(ac_unit_t *unit) {
+    ac_saved_state_t saved;
+    ac_saved_state_fill(unit, &saved);
+
+    if (unit->saved_state_valid && !memcmp(&saved, &unit->saved_state, sizeof(saved)))
+        return;
+
+    char key[16];
+    ac_unit_key(unit, AC_SAVED_STATE_KEY, key, sizeof(key));
+    if (sysparam_set_data(key, (uint8_t*)&saved, sizeof(saved), true) != SYSPARAM_OK)
+        return;
+
+    unit->saved_state = saved;
+    unit->saved_state_valid = true;
+    unit->state_saves++;
+    ac_state_saves++;
+}
+
+// Called before AC task and HomeKit server start, so values are set
+// directly without notifications
+bool ac_state_restore(ac_unit_t *unit) {
+    ac_saved_state_t saved;
+    size_t length;
+    bool is_binary;
+    char key[16];
+    ac_unit_key(unit, AC_SAVED_STATE_KEY, key, sizeof(key));
+    if (sysparam_get_data_static(key, (uint8_t*)&saved, sizeof(saved),
+                                 &length, &is_binary) != SYSPARAM_OK)
+        return false;
+
+    if (!is_binary || length != sizeof(saved) || saved.version != AC_SAVED_STATE_VERSION)
+        return false;
+
+    unit->state.command = saved.command;
+    unit->state.mode = saved.mode;
+    unit->state.fan = saved.fan;
+    unit->state.swing = saved.swing;
+    unit->state.temperature = saved.temperature;
+    unit->fan = saved.fan_only;
+
+    unit->target_state.value = HOMEKIT_UINT8(saved.target_state);
+    unit->fan_active.value = HOMEKIT_UINT8(saved.fan_active);
+    unit->fan_swing_mode.value = HOMEKIT_UINT8(saved.fan_swing_mode);
+    unit->target_temperature.value = HOMEKIT_FLOAT(saved.target_temperature);
+    unit->fan_rotation_speed.value = HOMEKIT_FLOAT(saved.fan_rotation_speed);
+
+    // Until the first sensor reading AUTO is shown as cooling
+    switch (saved.target_state) {
+    case HOMEKIT_TARGET_HEATING_COOLING_STATE_HEAT:
+        unit->current_state.value = HOMEKIT_UINT8(HOMEKIT_CURRENT_HEATING_COOLING_STATE_HEAT);
+        break;
+    case HOMEKIT_TARGET_HEATING_COOLING_STATE_COOL:
+    case HOMEKIT_TARGET_HEATING_COOLING_STATE_AUTO:
+        unit->current_state.value = HOMEKIT_UINT8(HOMEKIT_CURRENT_HEATING_COOLING_STATE_COOL);
+        break;
+    default:
+        unit->current_state.value = HOMEKIT_UINT8(HOMEKIT_CURRENT_HEATING_COOLING_STATE_OFF);
+    }
+
+    if (saved.last_frame_valid)
+        ac_set_last_frame(unit, saved.last_frame);
+
+    unit->saved_state = saved;
+    unit->saved_state_valid = true;
+
+    return true;
+}
+
+
+// Model detected from remote frames, kept in sysparam over the configured
+// one. Written only when it changes.
+#define AC_MODEL_KEY "ac_model"
+
+uint32_t ac_model_switches = 0;
+
+void ac_model_restore(ac_unit_t *unit) {
+    char key[16];
+    int8_t model;
+    ac_unit_key(unit, AC_MODEL_KEY, key, sizeof(key));
+    if (sysparam_get_int8(key, &model) == SYSPARAM_OK && fujitsu_ac_ir_model_valid(model))
+        unit->model = model;
+}
+
+void ac_model_set(ac_unit_t *unit, fujitsu_ac_model model) {
+    if (model == unit->model || !fujitsu_ac_ir_model_valid(model))
+        return;
+
+    printf("AC %d model %d detected, was %d\n", ac_unit_index(unit), model, unit->model);
+    trace(trace_model_detected, (ac_unit_index(unit) << 8) | model, 0);
+
+    char key[16];
+    ac_unit_key(unit, AC_MODEL_KEY, key, sizeof(key));
+    sysparam_set_int8(key, model);
+
+    unit->model = model;
+    ac_model_switches++;
+
+    // Nothing sent with the old model has reached the AC
+    unit->last_frame_valid = false;
+    if (ac_tx_unit == unit)
+        ac_tx_unit = NULL;
+}
+
+
+// Put the next event into AC's timer, or stop the timer if there is
+// nothing to wait for any more
+void ac_schedule_push(ac_unit_t *unit) {
+    fujitsu_ac_timer_t timer = ac_schedule_timer(&unit->schedule, schedule_now());
+    if (timer.type == ac_timer_none && !unit->schedule.timer_armed)
+        return;
+
+    // Timer frames carry current state without switching power
+    fujitsu_ac_state_t state = unit->state;
+    state.command = ac_cmd_stay_on;
+
+    // but for AC that is off only on timer keeps it off: anything else
+    // waits for the event, and stopping the timer takes a turn off
+    if (unit->state.command == ac_cmd_turn_off && timer.type != ac_timer_on) {
+        if (!unit->schedule.timer_armed)
+            return;
+
+        state.command = ac_cmd_turn_off;
+        timer.type = ac_timer_none;
+    }
+
+    fujitsu_ac_packed_state_t packed_state = fujitsu_ac_state_pack(&state);
+    unit->timer_frames++;
+    if (ac_ir_send(unit, packed_state, &timer) < 0) {
+        unit->schedule.timer_armed = false;
+        return;
+    }
+
+    ac_schedule_frame(&unit->schedule, packed_state, &timer);
+    printf("AC %d timer: %s\n", ac_unit_index(unit), !unit->schedule.timer_armed ? "stopped" :
+           timer.type == ac_timer_on ? "on" : "off");
+}
+
+void ac_schedule_set(ac_unit_t *unit, int minutes) {
+    if (!ac_schedule_add(&unit->schedule, schedule_now(), minutes)) {
+        printf("AC %d schedule is full\n", ac_unit_index(unit));
+        return;
+    }
+
+    if (ac_schedule_stale(&unit->schedule, schedule_now()))
+        ac_schedule_push(unit);
+}
+
+// Reflect events that are due. Returns true if state changed.
+bool ac_schedule_poll(ac_unit_t *unit) {
+    bool changed = false;
+    ac_event_t event;
+    bool by_timer;
+    while (ac_schedule_take(&unit->schedule, schedule_now(), &event, &by_timer)) {
+        fujitsu_ac_state_t state = unit->state;
+        state.command = event.on ? ac_cmd_turn_on : ac_cmd_turn_off;
+
+        // AC has done it on its own, same as if its remote was pressed
+        ac_apply_remote_state(unit, fujitsu_ac_state_pack(&state));
+        if (!by_timer) {
+            unit->last_frame_valid = false;
+            ac_update_state(unit, false);
+        }
+
+        changed = true;
+    }
+
+    if (ac_schedule_stale(&unit->schedule, schedule_now()))
+        ac_schedule_push(unit);
+
+    return changed;
+}
+
+// Ticks until AC task has to look at unit's schedule again
+TickType_t ac_schedule_ticks(ac_unit_t *unit) {
+    uint32_t ms = ac_schedule_wait(&unit->schedule, schedule_now());
+    if (ms == UINT32_MAX)
+        return portMAX_DELAY;
 
-    int result = fujitsu_ac_ir_send(&new_ac_state);
-    if (result < 0) {
-        printf("Fujitsu command send failed (code %d)\n", result);
+    return (ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+}
+
+// Turn AC on (minutes > 0) or off (minutes < 0) after given number of
+// minutes, 0 cancels all scheduled events. Safe to call from any task.
+void ac_schedule(int unit, int minutes) {
+    if (unit < 0 || unit >= AC_UNITS)
         return;
+
+    ac_post(&ac_units[unit], ac_input_timer, (ac_input_value_t) {.int_value = minutes});
+}
+
+
+// Learned remote timings (see fujitsu_ac_ir_get_timing()) are kept in
+// sysparam and only rewritten when they drift by more than 2%
+static const fujitsu_ac_model ir_timing_models[] = {
+    fujitsu_ac_model_ARRAH2E,
+    fujitsu_ac_model_ARDB1,
+};
+static uint16_t ir_timing_saved[countof(ir_timing_models)];
+
+static void ir_timing_key(fujitsu_ac_model model, char *key, size_t key_size) {
+    snprintf(key, key_size, "ir_timing_%d", model);
+}
+
+void ir_timing_restore() {
+    char key[16];
+    for (int i=0; i < countof(ir_timing_models); i++) {
+        int32_t scale;
+        ir_timing_key(ir_timing_models[i], key, sizeof(key));
+        if (sysparam_get_int32(key, &scale) == SYSPARAM_OK)
+            fujitsu_ac_ir_set_timing(ir_timing_models[i], scale);
+
+        ir_timing_saved[i] = fujitsu_ac_ir_get_timing(ir_timing_models[i]);
     }
+}
 
-    ac_state = new_ac_state;
+void ir_timing_save() {
+    char key[16];
+    for (int i=0; i < countof(ir_timing_models); i++) {
+        uint16_t scale = fujitsu_ac_ir_get_timing(ir_timing_models[i]);
+        if (abs(scale - ir_timing_saved[i]) <= FUJITSU_AC_IR_TIMING_NOMINAL / 50)
+            continue;
 
-    if (!homekit_value_equal(&new_current_state, &current_state.value)) {
-        current_state.value = new_current_state;
-        homekit_characteristic_notify(&current_state, current_state.value);
+        ir_timing_key(ir_timing_models[i], key, sizeof(key));
+        if (sysparam_set_int32(key, scale) == SYSPARAM_OK)
+            ir_timing_saved[i] = scale;
     }
+}
+
+
+#define AC_TX_REFRESH_TICKS (AC_TX_REFRESH_PERIOD * 1000 / portTICK_PERIOD_MS)
+
+static bool ac_refresh_due(ac_unit_t *unit) {
+    return AC_TX_REFRESH_TICKS && xTaskGetTickCount() - unit->last_frame_ticks >= AC_TX_REFRESH_TICKS;
+}
 
-    if (!homekit_value_equal(&new_fan_active, &fan_active.value)) {
-        fan_active.value = new_fan_active;
-        homekit_characteristic_notify(&fan_active, fan_active.value);
+// Take unit's inputs and rate how urgent serving them is
+static void ac_unit_take(ac_unit_t *unit) {
+    unit->pending = ac_inbox_take(&unit->inbox, &unit->inputs);
+    unit->priority = ac_tx_priority_idle;
+    unit->priority_time = sdk_system_get_time();
+
+    uint32_t user = unit->pending & (AC_INPUT_HOMEKIT_MASK | AC_INPUT_BIT(ac_input_remote));
+    if (user) {
+        unit->priority = ac_tx_priority_user;
+        for (int i=0; i < ac_input_count; i++) {
+            if ((user & AC_INPUT_BIT(i)) &&
+                    (int32_t)(unit->inputs.input_time[i] - unit->priority_time) < 0)
+                unit->priority_time = unit->inputs.input_time[i];
+        }
+    } else if (unit->pending || ac_schedule_due(&unit->schedule, schedule_now()) ||
+               (unit->schedule.count && !unit->schedule.timer_armed)) {
+        unit->priority = ac_tx_priority_schedule;
+    } else if (ac_refresh_due(unit)) {
+        unit->priority = ac_tx_priority_refresh;
     }
+}
+
+// Units with work, in the order they are served
+static int ac_unit_order(ac_unit_t **order) {
+    int count = 0;
+    for (int i=0; i < AC_UNITS; i++) {
+        ac_unit_t *unit = &ac_units[i];
+        if (unit->priority == ac_tx_priority_idle)
+            continue;
 
-    if (!homekit_value_equal(&new_rotation_speed, &fan_rotation_speed.value)) {
-        fan_rotation_speed.value = new_rotation_speed;
-        homekit_characteristic_notify(&fan_rotation_speed, fan_rotation_speed.value);
+        int j = count++;
+        for (; j > 0; j--) {
+            ac_unit_t *other = order[j-1];
+            if (other->priority > unit->priority ||
+                    (other->priority == unit->priority &&
+                     (int32_t)(other->priority_time - unit->priority_time) <= 0))
+                break;
+            order[j] = other;
+        }
+        order[j] = unit;
     }
+
+    return count;
 }
 
+static void ac_unit_serve(ac_unit_t *unit) {
+    uint32_t pending = unit->pending;
+    ac_inbox_t *inputs = &unit->inputs;
+
+    if (pending & AC_INPUT_BIT(ac_input_model))
+        ac_model_set(unit, inputs->values[ac_input_model].int_value);
+
+    if (pending & AC_INPUT_BIT(ac_input_timing))
+        ir_timing_save();
+
+    ac_schedule_poll(unit);
+
+    if (pending & AC_INPUT_BIT(ac_input_remote))
+        ac_apply_remote_state(unit, inputs->values[ac_input_remote].ac_state);
+
+    if (pending & AC_INPUT_BIT(ac_input_timer))
+        ac_schedule_set(unit, inputs->values[ac_input_timer].int_value);
+
+    bool homekit_changed = false;
+    uint32_t homekit_time = 0;
+    for (int i=0; i < ac_input_count; i++) {
+        if (!(pending & AC_INPUT_HOMEKIT_MASK & AC_INPUT_BIT(i)))
+            continue;
+
+        // Remote press that came later wins
+        if (ac_inbox_superseded(inputs, i))
+            continue;
+
+        ac_apply_homekit_input(unit, i, &inputs->values[i]);
+        if (!homekit_changed || (int32_t)(inputs->input_time[i] - homekit_time) < 0)
+            homekit_time = inputs->input_time[i];
+        homekit_changed = true;
+    }
+
+    if (pending & AC_INPUT_BIT(ac_input_current_temperature))
+        ac_apply_current_temperature(unit, inputs->values[ac_input_current_temperature].float_value);
+
+    // Sends a frame only when the loop switches mode
+    bool control_changed = false;
+    if (pending & AC_INPUT_BIT(ac_input_current_temperature)) {
+        control_changed = ac_control_update(unit, true);
+    } else if (pending & (AC_INPUT_BIT(ac_input_target_state) |
+                          AC_INPUT_BIT(ac_input_target_temperature))) {
+        control_changed = ac_control_update(unit, false);
+    }
+
+    if (homekit_changed) {
+        unit->tx_updates++;
+        ac_update_state(unit, false);
+        histogram_add(&unit->homekit_latency, sdk_system_get_time() - homekit_time);
+    } else if (control_changed) {
+        ac_update_state(unit, false);
+    }
+
+    // Put next event back into the timer a turn off or remote press above
+    // has stopped
+    if (ac_schedule_stale(&unit->schedule, schedule_now()))
+        ac_schedule_push(unit);
+
+    // Anything sent above restarted the period
+    if (ac_refresh_due(unit)) {
+        unit->tx_refreshes++;
+        ac_update_state(unit, true);
+    }
+
+    notify_flush();
+    ac_state_save(unit);
+
+    if (pending & AC_INPUT_BIT(ac_input_remote))
+        histogram_add(&unit->remote_latency, sdk_system_get_time() - inputs->input_time[ac_input_remote]);
+
+    unit->pending = 0;
+    unit->priority = ac_tx_priority_idle;
+}
+
+
+void ac_task(void *_args) {
+    ac_task_handle = xTaskGetCurrentTaskHandle();
+
+    // Push initial state to every AC, unless it was restored: then the AC
+    // already has it
+    for (int i=0; i < AC_UNITS; i++) {
+        ac_unit_t *unit = &ac_units[i];
+        if (!unit->restored)
+            ac_update_state(unit, false);
+        notify_flush();
+        ac_state_save(unit);
+    }
+
+    ac_unit_t *order[AC_UNITS];
+    while (true) {
+        TickType_t wait = portMAX_DELAY;
+        for (int i=0; i < AC_UNITS; i++)
+            wait = MIN(wait, ac_schedule_ticks(&ac_units[i]));
+        if (AC_TX_REFRESH_TICKS)
+            wait = MIN(wait, AC_TX_REFRESH_TICKS);
+        ulTaskNotifyTake(pdTRUE, wait);
+
+        uint32_t pending = 0;
+        for (int i=0; i < AC_UNITS; i++)
+            pending |= ac_inbox_pending(&ac_units[i].inbox);
+        if ((pending & AC_INPUT_HOMEKIT_MASK) && AC_TX_COALESCE_WINDOW > 0) {
+            // Let the rest of a multi-characteristic write arrive
+            vTaskDelay(AC_TX_COALESCE_WINDOW / portTICK_PERIOD_MS);
+        }
+
+        for (int i=0; i < AC_UNITS; i++)
+            ac_unit_take(&ac_units[i]);
+
+        int count = ac_unit_order(order);
+        for (int i=0; i < count; i++)
+            ac_unit_serve(order[i]);
+    }
+
+    vTaskDelete(NULL);
+}
+
+
+// Receiver output is low during marks; spaces within a burst are shorter
+// than 2ms, so a line that stays high that long is between bursts
+bool ir_line_idle() {
+    for (int i=0; i < 20; i++) {
+        if (!gpio_read(IR_RX_GPIO))
+            return false;
+        sdk_os_delay_us(100);
+    }
+    return true;
+}
+
+bool ir_quiet() {
+    return sdk_system_get_time() - ir_activity_time >= SENSOR_IR_HOLDOFF * 1000 && ir_line_idle();
+}
+
+bool sensor_read(float *humidity_value, float *temperature_value) {
+    int defers = 0;
+    while (!ir_quiet()) {
+        if (defers >= SENSOR_MAX_DEFERS) {
+            sensor_forced++;
+            break;
+        }
+        defers++;
+        sensor_defers++;
+        vTaskDelay(SENSOR_RETRY_DELAY / portTICK_PERIOD_MS);
+    }
+    if (defers)
+        trace(trace_sensor_deferred, defers, 0);
+
+    uint32_t read_start = sdk_system_get_time();
+    sensor_reads++;
+    bool success = dht_read_float_data(
+        DHT_TYPE_DHT11, TEMPERATURE_SENSOR_GPIO,
+        humidity_value, temperature_value
+    );
+
+    if (!success)
+        sensor_failures++;
+
+    // A burst that started during the read ends after it
+    if ((int32_t)(ir_activity_time - read_start) >= 0 || !ir_line_idle())
+        sensor_collisions++;
+
+    return success;
+}
 
 void temperature_sensor_task(void *_args) {
     gpio_set_pullup(TEMPERATURE_SENSOR_GPIO, false, false);
 
+    sensor_ring_init(&temperature_ring);
+    sensor_ring_init(&humidity_ring);
+
     float humidity_value, temperature_value;
+    float temperature_sent = 0;
     while (1) {
-        bool success = dht_read_float_data(
-            DHT_TYPE_DHT11, TEMPERATURE_SENSOR_GPIO,
-            &humidity_value, &temperature_value
-        );
-        if (success) {
-            printf("Got readings: temperature %g, humidity %g\n", temperature_value, humidity_value);
-            current_temperature.value = HOMEKIT_FLOAT(temperature_value);
-            current_humidity.value = HOMEKIT_FLOAT(humidity_value);
+        bool success = sensor_read(&humidity_value, &temperature_value);
+        for (int i=0; i < SENSOR_READ_RETRIES && !success; i++) {
+            vTaskDelay(SENSOR_READ_RETRY_DELAY / portTICK_PERIOD_MS);
+            success = sensor_read(&humidity_value, &temperature_value);
+        }
 
-            homekit_characteristic_notify(&current_temperature, current_temperature.value);
-            homekit_characteristic_notify(&current_humidity, current_humidity.value);
+        if (success) {
+            trace(trace_sensor_reading, (int16_t)(temperature_value * 10), 0);
+            temperature_value = sensor_ring_add(&temperature_ring, temperature_value);
+            humidity_value = sensor_ring_add(&humidity_ring, humidity_value);
+            printf("Got readings: temperature %g, humidity %g (filtered)\n",
+                   temperature_value, humidity_value);
+
+            if (fabsf(humidity_value - current_humidity.value.float_value) >= SENSOR_HUMIDITY_DELTA) {
+                sensor_updates++;
+                current_humidity.value = HOMEKIT_FLOAT(humidity_value);
+                homekit_characteristic_notify(&current_humidity, current_humidity.value);
+            } else {
+                sensor_updates_skipped++;
+            }
 
-            // If in AUTO mode, update current real mode based on temperature
-            if (target_state.value.int_value == HOMEKIT_TARGET_HEATING_COOLING_STATE_AUTO) {
-                homekit_value_t new_current_state;
-                if (current_temperature.value.int_value < target_temperature.value.int_value) {
-                    new_current_state = HOMEKIT_UINT8(HOMEKIT_CURRENT_HEATING_COOLING_STATE_HEAT);
-                } else {
-                    new_current_state = HOMEKIT_UINT8(HOMEKIT_CURRENT_HEATING_COOLING_STATE_COOL);
-                }
-                if (!homekit_value_equal(&new_current_state, &current_state.value)) {
-                    current_state.value = new_current_state;
-                    homekit_characteristic_notify(&current_state, current_state.value);
-                }
+            // Units apply the same delta to their characteristics
+            if (fabsf(temperature_value - temperature_sent) >= SENSOR_TEMPERATURE_DELTA) {
+                sensor_updates++;
+                temperature_sent = temperature_value;
+            } else {
+                sensor_updates_skipped++;
             }
+
+            // One sensor for the room all units are in
+            for (int i=0; i < AC_UNITS; i++)
+                ac_post(&ac_units[i], ac_input_current_temperature,
+                        (ac_input_value_t) {.float_value = temperature_value});
         } else {
             printf("Couldn't read data from sensor\n");
+            trace(trace_sensor_failed, 0, -1);
         }
 
         vTaskDelay(TEMPERATURE_POLL_PERIOD / portTICK_PERIOD_MS);
@@ -248,96 +1409,123 @@ void temperature_sensor_task(void *_args) {
 }
 
 
-void ir_rx_task(void *_args) {
-    printf("Running IR task\n");
-    ir_decoder_t *decoder = fujitsu_ac_ir_make_decoder();
+// Secondary remote (e.g. a TV remote), only traced for now
+static ir_generic_config_t nec_config = {
+    .header_mark = 9000,
+    .header_space = -4500,
 
-    fujitsu_ac_state_t state;
-    while (true) {
-        int size = ir_recv(decoder, 0, &state, sizeof(state));
-        if (size < 0) {
-            printf("Bit decoding failed\n");
-            continue;
+    .bit1_mark = 560,
+    .bit1_space = -1690,
+
+    .bit0_mark = 560,
+    .bit0_space = -560,
+
+    .footer_mark = 560,
+    .footer_space = -20000,
+
+    .tolerance = 25,
+};
+
+static const ir_protocol_t nec_protocol = {
+    .name = "NEC",
+    .header_mark = 9000,
+    .header_space = -4500,
+    .tolerance = 25,
+    // 32 bits, with or without footer space
+    .min_pulses = 2 + 32 * 2 + 1,
+    .max_pulses = 2 + 32 * 2 + 2,
+};
+
+static int ir_protocol_fujitsu = -1;
+static int ir_protocol_nec = -1;
+
+
+// Frames of a model no unit is set to, in a row. Most likely units were
+// set up with the wrong model and ignore everything sent to them.
+static fujitsu_ac_model ir_rx_unknown_model;
+static int ir_rx_unknown_model_frames = 0;
+
+// Returns true if some unit is set to model, otherwise switches all units
+// to it once it has been seen AC_MODEL_DETECT_FRAMES times in a row
+static bool ir_rx_detect_model(fujitsu_ac_model model) {
+    for (int i=0; i < AC_UNITS; i++) {
+        if (ac_units[i].model == model) {
+            ir_rx_unknown_model_frames = 0;
+            return true;
         }
+    }
 
-        xEventGroupClearBits(sync_flags, SYNC_FLAGS_UPDATE);
+    if (!AC_MODEL_DETECT_FRAMES)
+        return false;
 
-        ac_state = state;
+    if (!ir_rx_unknown_model_frames || model != ir_rx_unknown_model) {
+        ir_rx_unknown_model = model;
+        ir_rx_unknown_model_frames = 0;
+    }
 
-        homekit_value_t new_target_state, new_fan_active;
-        if (state.command == ac_cmd_turn_off) {
-            fan = 0;
-            new_target_state = HOMEKIT_UINT8(0);
-            new_fan_active = HOMEKIT_UINT8(0);
-        } else if (state.command == ac_cmd_turn_on || state.command == ac_cmd_stay_on) {
-            fan = 0;
-            switch (state.mode) {
-            case ac_mode_heat:
-                new_target_state = HOMEKIT_UINT8(1);
-                break;
-            case ac_mode_cool:
-                new_target_state = HOMEKIT_UINT8(2);
-                break;
-            case ac_mode_auto:
-                new_target_state = HOMEKIT_UINT8(3);
-                break;
-            case ac_mode_dry:
-            case ac_mode_fan:
-                new_target_state = HOMEKIT_UINT8(0);
-                break;
-            }
+    if (++ir_rx_unknown_model_frames >= AC_MODEL_DETECT_FRAMES) {
+        ir_rx_unknown_model_frames = 0;
+        for (int i=0; i < AC_UNITS; i++)
+            ac_post(&ac_units[i], ac_input_model, (ac_input_value_t) {.int_value = model});
+    }
 
-            new_fan_active = HOMEKIT_UINT8(1);
+    return false;
+}
 
-            homekit_value_t new_target_temperature = HOMEKIT_FLOAT(state.temperature);
-            homekit_value_t new_fan_rotation_speed;
-            switch (state.fan) {
-            case ac_fan_auto:
-            case ac_fan_high:
-                new_fan_rotation_speed = HOMEKIT_FLOAT(100);
-                break;
-            case ac_fan_med:
-                new_fan_rotation_speed = HOMEKIT_FLOAT(75);
-                break;
-            case ac_fan_low:
-                new_fan_rotation_speed = HOMEKIT_FLOAT(45);
-                break;
-            case ac_fan_quiet:
-                new_fan_rotation_speed = HOMEKIT_FLOAT(15);
-                break;
-            }
-            homekit_value_t new_fan_swing_mode = HOMEKIT_UINT8((state.swing == ac_swing_off) ? 0 : 1);
 
-            if (!homekit_value_equal(&new_target_temperature, &target_temperature.value)) {
-                target_temperature.value = new_target_temperature;
-                homekit_characteristic_notify(&target_temperature, target_temperature.value);
-            }
+void ir_rx_task(void *_args) {
+    printf("Running IR task\n");
 
-            if (!homekit_value_equal(&new_fan_rotation_speed, &fan_rotation_speed.value)) {
-                fan_rotation_speed.value = new_fan_rotation_speed;
-                homekit_characteristic_notify(&fan_rotation_speed, fan_rotation_speed.value);
-            }
+    ir_decoder_t *fujitsu_decoder = fujitsu_ac_ir_make_decoder();
+    ir_decoder_t *nec_decoder = ir_generic_make_decoder(&nec_config);
+    ir_protocol_fujitsu = ir_dispatch_register(&fujitsu_ac_ir_protocol, fujitsu_decoder);
+    ir_protocol_nec = ir_dispatch_register(&nec_protocol, nec_decoder);
+
+    ir_decoder_t *decoder = ir_capture_make_decoder(ir_dispatch_make_decoder());
+
+    uint8_t buffer[IR_DISPATCH_RESULT_SIZE(sizeof(fujitsu_ac_ir_result_t))] __attribute__((aligned(4)));
+    ir_dispatch_result_t *result = (ir_dispatch_result_t*) buffer;
+    while (true) {
+        int size = ir_recv(decoder, 0, buffer, sizeof(buffer));
+        ir_activity_time = sdk_system_get_time();
+
+        // Failures are counted and traced by decoders, most of them are
+        // other remotes anyway
+        if (size < 0)
+            continue;
 
-            if (!homekit_value_equal(&new_fan_swing_mode, &fan_swing_mode.value)) {
-                fan_swing_mode.value = new_fan_swing_mode;
-                homekit_characteristic_notify(&fan_swing_mode, fan_swing_mode.value);
+        if (result->protocol == ir_protocol_fujitsu) {
+            fujitsu_ac_ir_result_t *frame = (fujitsu_ac_ir_result_t*) result->data;
+            if (frame->timer.type != ac_timer_none) {
+                fujitsu_ac_state_t state;
+                fujitsu_ac_state_unpack(frame->state, &state);
+                state.timer = frame->timer;
+                fujitsu_ac_print_state("Remote set AC timer", &state);
             }
-        }
 
-        if (!homekit_value_equal(&new_target_state, &target_state.value)) {
-            target_state.value = new_target_state;
-            homekit_characteristic_notify(&target_state, target_state.value);
-        }
+            // Frames carry no unit address: a press is meant for every
+            // unit of its model, or for all if none is set to it
+            bool model_known = ir_rx_detect_model(frame->model);
 
-        if (!homekit_value_equal(&new_fan_active, &fan_active.value)) {
-            fan_active.value = new_fan_active;
-            homekit_characteristic_notify(&fan_active, fan_active.value);
-        }
+            // AC stays off until on timer fires
+            if (frame->timer.type != ac_timer_on) {
+                for (int i=0; i < AC_UNITS; i++) {
+                    if (!model_known || ac_units[i].model == frame->model)
+                        ac_post(&ac_units[i], ac_input_remote, (ac_input_value_t) {.ac_state = frame->state});
+                }
+            }
 
-        xEventGroupSetBits(sync_flags, SYNC_FLAGS_UPDATE);
+            // Sysparam is written by AC task only
+            ac_post(&ac_units[0], ac_input_timing, (ac_input_value_t) {.int_value = 0});
+        } else if (result->protocol == ir_protocol_nec && size >= 4) {
+            // address, ~address, command, ~command
+            trace(trace_ir_nec, (result->data[0] << 8) | result->data[2], 0);
+        }
     }
 
     decoder->free(decoder);
+    fujitsu_decoder->free(fujitsu_decoder);
+    nec_decoder->free(nec_decoder);
 
     vTaskDelete(NULL);
 }
@@ -357,16 +1545,230 @@ void thermostat_identify_task(void *_args) {
 
     led_write(false);
 
+    task_monitor_exit();
     vTaskDelete(NULL);
 }
 
 void thermostat_identify(homekit_value_t _value) {
     printf("Thermostat identify\n");
-    xTaskCreate(thermostat_identify_task, "Thermostat identify", 128, NULL, 2, NULL);
+    TaskHandle_t handle = NULL;
+    xTaskCreate(thermostat_identify_task, "Thermostat identify", IDENTIFY_TASK_STACK_SIZE,
+                NULL, 2, &handle);
+    task_monitor_add(handle, "Thermostat identify", IDENTIFY_TASK_STACK_SIZE);
+}
+
+void stats_print() {
+    fujitsu_ac_ir_stats_t ir_stats;
+    fujitsu_ac_ir_get_stats(&ir_stats);
+
+    ir_dispatch_stats_t dispatch_stats;
+    ir_dispatch_get_stats(&dispatch_stats);
+
+    printf("IR bursts by protocol: unknown %u", dispatch_stats.unknown);
+    for (int i=0; i < ir_dispatch_protocol_count(); i++)
+        printf(", %s %u", ir_dispatch_protocol_name(i), dispatch_stats.hits[i]);
+    printf("\n");
+
+    printf("IR RX: %u bursts, %u decoded, %u of them after timing calibration\n",
+           ir_stats.frames_received, ir_stats.frames_decoded, ir_stats.frames_calibrated);
+    for (int i=0; i < countof(ir_timing_models); i++)
+        printf("  timing of model %d remote: %u/%u\n", ir_timing_models[i],
+               fujitsu_ac_ir_get_timing(ir_timing_models[i]), FUJITSU_AC_IR_TIMING_NOMINAL);
+    for (int i=fujitsu_ac_ir_error_buffer; i < fujitsu_ac_ir_error_count; i++) {
+        if (ir_stats.errors[i])
+            printf("  %-12s %u\n", fujitsu_ac_ir_error_string(i), ir_stats.errors[i]);
+    }
+    histogram_print("  decode us", &ir_stats.decode_time);
+
+    printf("IR TX: cache %u hits/%u misses\n", ir_stats.cache_hits, ir_stats.cache_misses);
+    histogram_print("  send us", &send_time);
+
+    printf("HomeKit events: %u sent, %u suppressed\n",
+           notify_events, notify_changes - notify_events);
+    printf("AC state saved to flash %u times, model switched %u times\n",
+           ac_state_saves, ac_model_switches);
+
+    for (int i=0; i < AC_UNITS; i++) {
+        ac_unit_t *unit = &ac_units[i];
+        printf("AC %d (%s, model %d): %u frames, %u saved by coalescing, %u duplicates suppressed, "
+               "%u refreshes, %u saves\n",
+               i, unit->config->name, unit->model,
+               unit->tx_frames, unit->tx_requests - unit->tx_updates, unit->tx_suppressed,
+               unit->tx_refreshes, unit->state_saves);
+        histogram_print("  HomeKit write to sent us", &unit->homekit_latency);
+        histogram_print("  waited for other units us", &unit->tx_wait);
+        histogram_print("  remote to notified us", &unit->remote_latency);
+        printf("  schedule: %d events pending, next %s, %u done, %u timer frames\n",
+               unit->schedule.count, unit->schedule.timer_armed ? "in AC timer" : "not in AC timer",
+               unit->schedule.events_done, unit->timer_frames);
+        if (THERMOSTAT_CONTROL) {
+            thermostat_control_t *control = &unit->control;
+            printf("  control: %s, %u updates, %u transitions, %u avoided "
+                   "(%u switching on every reading), %u held for min dwell\n",
+                   control->valid ? thermostat_mode_string(control->mode) : "idle",
+                   control->updates, control->transitions,
+                   thermostat_control_avoided(control),
+                   control->naive_transitions, control->dwell_holds);
+        }
+    }
+    printf("Sensor: %u reads, %u failed, put off %u times for IR, %u forced, %u overlapped IR\n",
+           sensor_reads, sensor_failures, sensor_defers, sensor_forced, sensor_collisions);
+    printf("  temperature %.1f, last %u: mean %.1f min %.1f max %.1f\n",
+           sensor_ring_median(&temperature_ring), temperature_ring.count,
+           sensor_ring_mean(&temperature_ring),
+           sensor_ring_min(&temperature_ring), sensor_ring_max(&temperature_ring));
+    printf("  humidity %.1f, last %u: mean %.1f min %.1f max %.1f\n",
+           sensor_ring_median(&humidity_ring), humidity_ring.count,
+           sensor_ring_mean(&humidity_ring),
+           sensor_ring_min(&humidity_ring), sensor_ring_max(&humidity_ring));
+    printf("  %u HomeKit updates, %u within delta held back\n",
+           sensor_updates, sensor_updates_skipped);
+
+    arena_print(&decoder_arena);
+    arena_print(&name_arena);
+    arena_print(&stack_arena);
+
+    task_monitor_print();
 }
 
+
+// Custom read-only characteristic with IR receive/transmit counters
+#define HOMEKIT_CHARACTERISTIC_CUSTOM_IR_STATS HOMEKIT_CUSTOM_UUID("F0000101")
+#define HOMEKIT_DECLARE_CHARACTERISTIC_CUSTOM_IR_STATS(_value, ...) \
+    .type = HOMEKIT_CHARACTERISTIC_CUSTOM_IR_STATS, \
+    .description = "IR stats", \
+    .format = homekit_format_string, \
+    .permissions = homekit_permissions_paired_read, \
+    .max_len = (int[]) {256}, \
+    .value = HOMEKIT_STRING_(_value), \
+    ##__VA_ARGS__
+
+homekit_value_t ir_stats_get() {
+    static char buffer[256];
+
+    fujitsu_ac_ir_stats_t ir_stats;
+    fujitsu_ac_ir_get_stats(&ir_stats);
+
+    uint32_t tx_frames = 0, tx_suppressed = 0;
+    for (int i=0; i < AC_UNITS; i++) {
+        tx_frames += ac_units[i].tx_frames;
+        tx_suppressed += ac_units[i].tx_suppressed;
+    }
+
+    int len = snprintf(buffer, sizeof(buffer), "rx %u ok %u calibrated %u",
+                       ir_stats.frames_received, ir_stats.frames_decoded,
+                       ir_stats.frames_calibrated);
+    for (int i=fujitsu_ac_ir_error_buffer; i < fujitsu_ac_ir_error_count && len < sizeof(buffer); i++) {
+        if (ir_stats.errors[i])
+            len += snprintf(buffer + len, sizeof(buffer) - len, ", %s %u",
+                            fujitsu_ac_ir_error_string(i), ir_stats.errors[i]);
+    }
+    if (len < sizeof(buffer)) {
+        snprintf(buffer + len, sizeof(buffer) - len,
+                 "; decode avg %uus; tx %u, suppressed %u, send avg %uus, max %uus",
+                 ir_stats.decode_time.count ? ir_stats.decode_time.sum / ir_stats.decode_time.count : 0,
+                 tx_frames, tx_suppressed,
+                 send_time.count ? send_time.sum / send_time.count : 0, send_time.max);
+    }
+
+    return HOMEKIT_STRING(buffer, .is_static=true);
+}
+
+homekit_characteristic_t ir_stats = HOMEKIT_CHARACTERISTIC_(CUSTOM_IR_STATS, "", .getter=ir_stats_get);
+
+
+// Custom read-only characteristic with stack use and CPU load of tasks
+#define HOMEKIT_CHARACTERISTIC_CUSTOM_TASK_STATS HOMEKIT_CUSTOM_UUID("F0000102")
+#define HOMEKIT_DECLARE_CHARACTERISTIC_CUSTOM_TASK_STATS(_value, ...) \
+    .type = HOMEKIT_CHARACTERISTIC_CUSTOM_TASK_STATS, \
+    .description = "Task stats", \
+    .format = homekit_format_string, \
+    .permissions = homekit_permissions_paired_read, \
+    .max_len = (int[]) {256}, \
+    .value = HOMEKIT_STRING_(_value), \
+    ##__VA_ARGS__
+
+// "<name> <used>/<stack> -> <recommended> <cpu>%" for every task we created
+homekit_value_t task_stats_get() {
+    static char buffer[256];
+    static task_monitor_task_t tasks[TASK_MONITOR_MAX_TASKS];
+
+    task_monitor_sample();
+    int count = task_monitor_get(tasks, countof(tasks));
+
+    int len = 0;
+    buffer[0] = 0;
+    for (int i=0; i < count && len < sizeof(buffer); i++) {
+        task_monitor_task_t *task = &tasks[i];
+        if (!task->stack_size || task->stack_free_min == UINT16_MAX)
+            continue;
+
+        len += snprintf(buffer + len, sizeof(buffer) - len, "%s%s %u/%u -> %u %u.%u%%",
+                        len ? "; " : "", task->name,
+                        task->stack_size - task->stack_free_min, task->stack_size,
+                        task_monitor_recommended_stack_size(task),
+                        task->cpu / 10, task->cpu % 10);
+    }
+
+    if (task_monitor_skipped() && len < sizeof(buffer))
+        snprintf(buffer + len, sizeof(buffer) - len, "%s%u samples skipped",
+                 len ? "; " : "", task_monitor_skipped());
+
+    return HOMEKIT_STRING(buffer, .is_static=true);
+}
+
+homekit_characteristic_t task_stats = HOMEKIT_CHARACTERISTIC_(CUSTOM_TASK_STATS, "", .getter=task_stats_get);
+
+
+// AC timer characteristic of a unit, see HOMEKIT_CHARACTERISTIC_CUSTOM_AC_TIMER
+homekit_value_t ac_timer_get(const homekit_characteristic_t *ch) {
+    ac_unit_t *unit = ac_unit_of(ch);
+    if (!unit->schedule.count)
+        return HOMEKIT_INT(0);
+
+    ac_event_t event = unit->schedule.events[0];
+    int32_t ms = event.time - schedule_now();
+    int minutes = (ms > 0) ? (ms + AC_SCHEDULE_MINUTE - 1) / AC_SCHEDULE_MINUTE : 0;
+
+    return HOMEKIT_INT(event.on ? minutes : -minutes);
+}
+
+void ac_timer_set(homekit_characteristic_t *ch, homekit_value_t value) {
+    int unit = ac_unit_index(ac_unit_of(ch));
+    trace(trace_homekit_write, (unit << 8) | ac_input_timer, 0);
+    ac_schedule(unit, value.int_value);
+}
+
+
 homekit_characteristic_t name = HOMEKIT_CHARACTERISTIC_(NAME, "Fujitsu AC");
 
+#define AC_THERMOSTAT_CHARACTERISTICS(i) \
+    &ac_units[i].current_temperature, \
+    &ac_units[i].target_temperature, \
+    &ac_units[i].current_state, \
+    &ac_units[i].target_state, \
+    &ac_units[i].units
+
+#define AC_FAN_SERVICE(i) \
+    HOMEKIT_SERVICE(FAN2, .characteristics=(homekit_characteristic_t*[]) { \
+        HOMEKIT_CHARACTERISTIC(NAME, "Fan"), \
+        &ac_units[i].fan_active, \
+        &ac_units[i].fan_rotation_speed, \
+        &ac_units[i].fan_swing_mode, \
+        NULL \
+    })
+
+// Services of units after the first one, which also has the room sensor
+// and stats
+#define AC_UNIT_SERVICES(i) \
+    HOMEKIT_SERVICE(THERMOSTAT, .characteristics=(homekit_characteristic_t*[]) { \
+        &ac_units[i].name, \
+        AC_THERMOSTAT_CHARACTERISTICS(i), \
+        &ac_units[i].timer, \
+        NULL \
+    }), \
+    AC_FAN_SERVICE(i)
+
 homekit_accessory_t *accessories[] = {
     HOMEKIT_ACCESSORY(.id=1, .category=homekit_accessory_category_thermostat, .services=(homekit_service_t*[]){
         HOMEKIT_SERVICE(ACCESSORY_INFORMATION, .characteristics=(homekit_characteristic_t*[]){
@@ -379,22 +1781,24 @@ homekit_accessory_t *accessories[] = {
             NULL
         }),
         HOMEKIT_SERVICE(THERMOSTAT, .primary=true, .characteristics=(homekit_characteristic_t*[]) {
-            HOMEKIT_CHARACTERISTIC(NAME, "Thermostat"),
+            &ac_units[0].name,
             &current_humidity,
-            &current_temperature,
-            &target_temperature,
-            &current_state,
-            &target_state,
-            &units,
-            NULL
-        }),
-        HOMEKIT_SERVICE(FAN2, .characteristics=(homekit_characteristic_t*[]) {
-            HOMEKIT_CHARACTERISTIC(NAME, "Fan"),
-            &fan_active,
-            &fan_rotation_speed,
-            &fan_swing_mode,
+            AC_THERMOSTAT_CHARACTERISTICS(0),
+            &ir_stats,
+            &task_stats,
+            &ac_units[0].timer,
             NULL
         }),
+        AC_FAN_SERVICE(0),
+#if AC_UNITS > 1
+        AC_UNIT_SERVICES(1),
+#endif
+#if AC_UNITS > 2
+        AC_UNIT_SERVICES(2),
+#endif
+#if AC_UNITS > 3
+        AC_UNIT_SERVICES(3),
+#endif
         NULL
     }),
     NULL
@@ -406,28 +1810,48 @@ homekit_server_config_t config = {
 };
 
 void on_wifi_ready() {
+#if WIFI_MODEM_SLEEP
+    sdk_wifi_set_sleep_type(WIFI_SLEEP_MODEM);
+#endif
     homekit_server_init(&config);
 }
 
 bool initialized = false;
 
 void init() {
-    sync_flags = xEventGroupCreate();
-    xEventGroupSetBits(sync_flags, SYNC_FLAGS_UPDATE);
+    for (int i=0; i < AC_UNITS; i++) {
+        ac_unit_t *unit = &ac_units[i];
+
+        unit->model = unit->config->model;
+        ac_model_restore(unit);
+
+        unit->state.command = ac_cmd_turn_off;
+        unit->state.temperature = 22;
+        unit->state.mode = ac_mode_auto;
+
+        unit->state.fan = ac_fan_auto;
+        unit->state.swing = ac_swing_off;
+
+        unit->restored = ac_state_restore(unit);
+        printf("AC %d state %s\n", i, unit->restored ? "restored" : "set to defaults");
 
-    ac_state.command = ac_cmd_turn_off;
-    ac_state.temperature = 22;
-    ac_state.mode = ac_mode_auto;
+        ac_schedule_init(&unit->schedule);
+        thermostat_control_init(&unit->control, THERMOSTAT_HEAT_BAND, THERMOSTAT_COOL_BAND,
+                                THERMOSTAT_MIN_DWELL * 1000);
 
-    ac_state.fan = ac_fan_auto;
-    ac_state.swing = ac_swing_off;
+        if (unit->config->tx_gate_gpio >= 0) {
+            gpio_enable(unit->config->tx_gate_gpio, GPIO_OUTPUT);
+            gpio_write(unit->config->tx_gate_gpio, false);
+        }
+    }
 
-    fujitsu_ac_ir_tx_init(fujitsu_ac_model_ARRAH2E);
+    fujitsu_ac_ir_tx_init(ac_units[0].model);
+    ir_timing_restore();
     ir_rx_init(IR_RX_GPIO, 300);
-    update_state();
+    ac_task_handle = task_create(ac_task, "AC", AC_TASK_STACK_SIZE, 2);
 
-    xTaskCreate(temperature_sensor_task, "Thermostat", 256, NULL, 2, NULL);
-    xTaskCreate(ir_rx_task, "IR receiver", 1024, NULL, 2, NULL);
+    task_create(temperature_sensor_task, "Thermostat", THERMOSTAT_TASK_STACK_SIZE, 2);
+    task_create(ir_rx_task, "IR receiver", IR_RX_TASK_STACK_SIZE, 2);
 
     initialized = true;
 }
@@ -451,18 +1875,56 @@ void create_accessory_name() {
 
     int name_len = snprintf(NULL, 0, "Fujitsu AC-%02X%02X%02X",
                             macaddr[3], macaddr[4], macaddr[5]);
-    char *name_value = malloc(name_len+1);
+    char *name_value = arena_alloc(&name_arena, name_len+1);
     snprintf(name_value, name_len+1, "Fujitsu AC-%02X%02X%02X",
              macaddr[3], macaddr[4], macaddr[5]);
 
     name.value = HOMEKIT_STRING(name_value);
 }
 
+void create_unit_names() {
+    for (int i=0; i < AC_UNITS; i++)
+        ac_units[i].name.value = HOMEKIT_STRING((char*)ac_units[i].config->name, .is_static=true);
+}
+
+// Single key commands over serial:
+//   t - dump trace records
+//   s - print IR, HomeKit and task statistics
+//   r - start/stop recording received IR bursts
+//   c - dump recorded IR bursts
+void console_task(void *_args) {
+    while (true) {
+        int c = getchar();
+        switch (c) {
+        case 't':
+            trace_dump();
+            break;
+        case 's':
+            stats_print();
+            break;
+        case 'r':
+            ir_capture_enable(!ir_capture_enabled());
+            printf("IR capture %s\n", ir_capture_enabled() ? "on" : "off");
+            break;
+        case 'c':
+            ir_capture_dump();
+            break;
+        }
+    }
+
+    vTaskDelete(NULL);
+}
+
+
 void user_init(void) {
     uart_set_baud(0, 115200);
+    trace(trace_boot, 0, 0);
 
     led_init();
     create_accessory_name();
+    create_unit_names();
+
+    task_create(console_task, "Console", CONSOLE_TASK_STACK_SIZE, 1);
 
     wifi_config_init("fujitsu-ac", NULL, on_wifi_ready);
 
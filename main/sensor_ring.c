@@ -0,0 +1,77 @@
+#include <string.h>
+
+#include "sensor_ring.h"
+
+
+#define RING_MASK (SENSOR_RING_SIZE - 1)
+
+#define SAMPLE(ring, seq) ((ring)->samples[(seq) & RING_MASK])
+
+
+void sensor_ring_init(sensor_ring_t *ring) {
+    memset(ring, 0, sizeof(*ring));
+}
+
+
+float sensor_ring_add(sensor_ring_t *ring, float value) {
+    int16_t sample = (value >= 0) ? (int16_t)(value * 10 + 0.5f) : (int16_t)(value * 10 - 0.5f);
+    uint32_t seq = ring->seq++;
+
+    if (ring->count == SENSOR_RING_SIZE) {
+        uint32_t oldest = seq - SENSOR_RING_SIZE;
+        ring->sum -= SAMPLE(ring, oldest);
+        if (ring->min_queue[ring->min_head & RING_MASK] == oldest)
+            ring->min_head++;
+        if (ring->max_queue[ring->max_head & RING_MASK] == oldest)
+            ring->max_head++;
+    } else {
+        ring->count++;
+    }
+
+    SAMPLE(ring, seq) = sample;
+    ring->sum += sample;
+
+    while (ring->min_tail != ring->min_head &&
+           SAMPLE(ring, ring->min_queue[(ring->min_tail - 1) & RING_MASK]) >= sample)
+        ring->min_tail--;
+    ring->min_queue[ring->min_tail++ & RING_MASK] = seq;
+
+    while (ring->max_tail != ring->max_head &&
+           SAMPLE(ring, ring->max_queue[(ring->max_tail - 1) & RING_MASK]) <= sample)
+        ring->max_tail--;
+    ring->max_queue[ring->max_tail++ & RING_MASK] = seq;
+
+    return sensor_ring_median(ring);
+}
+
+
+float sensor_ring_median(const sensor_ring_t *ring) {
+    int16_t window[SENSOR_MEDIAN_SIZE];
+    int count = (ring->count < SENSOR_MEDIAN_SIZE) ? ring->count : SENSOR_MEDIAN_SIZE;
+    if (!count)
+        return 0;
+
+    // Insertion sort, window is tiny
+    for (int i=0; i < count; i++) {
+        int16_t sample = SAMPLE(ring, ring->seq - 1 - i);
+        int j = i;
+        for (; j > 0 && window[j-1] > sample; j--)
+            window[j] = window[j-1];
+        window[j] = sample;
+    }
+
+    // Lower middle for even counts
+    return window[(count - 1) / 2] / 10.0f;
+}
+
+float sensor_ring_mean(const sensor_ring_t *ring) {
+    return ring->count ? (float)ring->sum / ring->count / 10.0f : 0;
+}
+
+float sensor_ring_min(const sensor_ring_t *ring) {
+    return ring->count ? SAMPLE(ring, ring->min_queue[ring->min_head & RING_MASK]) / 10.0f : 0;
+}
+
+float sensor_ring_max(const sensor_ring_t *ring) {
+    return ring->count ? SAMPLE(ring, ring->max_queue[ring->max_head & RING_MASK]) / 10.0f : 0;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+
+// Recent readings of a sensor, in tenths. Mean, min and max of the window
+// are kept up to date in O(1) per reading: a running sum plus monotonic
+// queues of candidates for min and max. Must be a power of two.
+#ifndef SENSOR_RING_SIZE
+#define SENSOR_RING_SIZE 32
+#endif
+
+// Readings taken the median of to reject DHT11 outliers, odd
+#ifndef SENSOR_MEDIAN_SIZE
+#define SENSOR_MEDIAN_SIZE 5
+#endif
+
+typedef struct {
+    int16_t samples[SENSOR_RING_SIZE];
+    uint32_t seq;     // readings added so far
+    uint16_t count;   // readings in window
+    int32_t sum;
+
+    // Sequence numbers of readings, values increasing (min) or decreasing
+    // (max) from head to tail
+    uint32_t min_queue[SENSOR_RING_SIZE], min_head, min_tail;
+    uint32_t max_queue[SENSOR_RING_SIZE], max_head, max_tail;
+} sensor_ring_t;
+
+
+void sensor_ring_init(sensor_ring_t *ring);
+
+// Add a reading, returns median of the last SENSOR_MEDIAN_SIZE readings
+float sensor_ring_add(sensor_ring_t *ring, float value);
+
+// Median of the last SENSOR_MEDIAN_SIZE readings (fewer right after init)
+float sensor_ring_median(const sensor_ring_t *ring);
+
+// Over the whole window, 0 if empty
+float sensor_ring_mean(const sensor_ring_t *ring);
+float sensor_ring_min(const sensor_ring_t *ring);
+float sensor_ring_max(const sensor_ring_t *ring);
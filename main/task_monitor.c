@@ -0,0 +1,196 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "task_monitor.h"
+
+
+static task_monitor_task_t tasks[TASK_MONITOR_MAX_TASKS];
+static int task_count = 0;
+static uint32_t samples_skipped = 0;
+
+#if configUSE_TRACE_FACILITY
+static TaskStatus_t task_status[TASK_MONITOR_MAX_TASKS];
+#endif
+
+#if configGENERATE_RUN_TIME_STATS
+static uint32_t total_run_time = 0;
+#endif
+
+
+// Entry of a live task, else entry of an exited task with the same name,
+// else a new one
+static task_monitor_task_t *task_find(TaskHandle_t handle, const char *name) {
+    for (int i=0; i < task_count; i++) {
+        if (tasks[i].handle == handle)
+            return &tasks[i];
+    }
+    for (int i=0; i < task_count; i++) {
+        if (!tasks[i].handle && !strncmp(tasks[i].name, name, TASK_MONITOR_NAME_SIZE-1))
+            return &tasks[i];
+    }
+
+    if (task_count >= TASK_MONITOR_MAX_TASKS)
+        return NULL;
+
+    task_monitor_task_t *task = &tasks[task_count++];
+    memset(task, 0, sizeof(*task));
+    task->stack_free_min = UINT16_MAX;
+    return task;
+}
+
+static void task_update_stack(task_monitor_task_t *task, uint16_t stack_free) {
+    if (stack_free < task->stack_free_min)
+        task->stack_free_min = stack_free;
+}
+
+
+void task_monitor_add(TaskHandle_t handle, const char *name, uint16_t stack_size) {
+    if (!handle)
+        return;
+
+    vTaskSuspendAll();
+    task_monitor_task_t *task = task_find(handle, name);
+    if (task) {
+        strncpy(task->name, name, TASK_MONITOR_NAME_SIZE-1);
+        task->handle = handle;
+        task->stack_size = stack_size;
+    }
+    xTaskResumeAll();
+}
+
+void task_monitor_exit() {
+    TaskHandle_t handle = xTaskGetCurrentTaskHandle();
+    uint16_t stack_free = uxTaskGetStackHighWaterMark(NULL);
+
+    vTaskSuspendAll();
+    for (int i=0; i < task_count; i++) {
+        if (tasks[i].handle == handle) {
+            task_update_stack(&tasks[i], stack_free);
+            tasks[i].handle = NULL;
+            tasks[i].cpu = 0;
+        }
+    }
+    xTaskResumeAll();
+}
+
+void task_monitor_sample() {
+    vTaskSuspendAll();
+
+#if configUSE_TRACE_FACILITY
+    uint32_t now = 0;
+    int count = uxTaskGetSystemState(task_status, TASK_MONITOR_MAX_TASKS, &now);
+    if (!count) {
+        // Too many tasks to fit: keep previous sample rather than take
+        // every task for exited
+        samples_skipped++;
+        xTaskResumeAll();
+        return;
+    }
+#if configGENERATE_RUN_TIME_STATS
+    uint32_t elapsed = now - total_run_time;
+    total_run_time = now;
+#endif
+
+    for (int i=0; i < task_count; i++) {
+        bool alive = false;
+        for (int j=0; j < count; j++)
+            alive |= (task_status[j].xHandle == tasks[i].handle);
+        if (!alive) {
+            tasks[i].handle = NULL;
+            tasks[i].cpu = 0;
+        }
+    }
+
+    for (int j=0; j < count; j++) {
+        TaskStatus_t *status = &task_status[j];
+        task_monitor_task_t *task = task_find(status->xHandle, status->pcTaskName);
+        if (!task)
+            continue;
+
+        if (!task->handle) {
+            strncpy(task->name, status->pcTaskName, TASK_MONITOR_NAME_SIZE-1);
+            task->handle = status->xHandle;
+            task->run_time = status->ulRunTimeCounter;
+        }
+
+        task_update_stack(task, status->usStackHighWaterMark);
+#if configGENERATE_RUN_TIME_STATS
+        uint32_t run_time = status->ulRunTimeCounter - task->run_time;
+        task->cpu = elapsed ? (uint64_t)run_time * 1000 / elapsed : 0;
+        task->run_time = status->ulRunTimeCounter;
+#endif
+    }
+#else
+    for (int i=0; i < task_count; i++) {
+        if (tasks[i].handle)
+            task_update_stack(&tasks[i], uxTaskGetStackHighWaterMark(tasks[i].handle));
+    }
+#endif
+
+    xTaskResumeAll();
+}
+
+uint32_t task_monitor_skipped() {
+    return samples_skipped;
+}
+
+int task_monitor_get(task_monitor_task_t *result, int max_tasks) {
+    vTaskSuspendAll();
+    int count = task_count < max_tasks ? task_count : max_tasks;
+    memcpy(result, tasks, count * sizeof(task_monitor_task_t));
+    xTaskResumeAll();
+
+    return count;
+}
+
+uint16_t task_monitor_recommended_stack_size(const task_monitor_task_t *task) {
+    if (!task->stack_size || task->stack_free_min > task->stack_size)
+        return 0;
+
+    uint32_t used = task->stack_size - task->stack_free_min;
+    uint32_t margin = used * TASK_MONITOR_MARGIN / 100;
+    if (margin < TASK_MONITOR_MIN_MARGIN)
+        margin = TASK_MONITOR_MIN_MARGIN;
+
+    return (used + margin + 31) & ~31;
+}
+
+void task_monitor_print() {
+    static task_monitor_task_t snapshot[TASK_MONITOR_MAX_TASKS];
+
+    task_monitor_sample();
+    int count = task_monitor_get(snapshot, TASK_MONITOR_MAX_TASKS);
+
+    printf("%-16s %6s %6s %6s %6s %11s\n", "Task", "stack", "used", "free", "cpu", "recommended");
+    for (int i=0; i < count; i++) {
+        task_monitor_task_t *task = &snapshot[i];
+        printf("%-16s", task->name);
+
+        if (task->stack_size) {
+            printf(" %6u", task->stack_size);
+        } else {
+            printf(" %6s", "-");
+        }
+
+        if (task->stack_free_min == UINT16_MAX) {
+            printf(" %6s %6s", "-", "-");
+        } else if (task->stack_size) {
+            printf(" %6u %6u", task->stack_size - task->stack_free_min, task->stack_free_min);
+        } else {
+            printf(" %6s %6u", "-", task->stack_free_min);
+        }
+
+        printf(" %3u.%u%%", task->cpu / 10, task->cpu % 10);
+
+        uint16_t recommended = task_monitor_recommended_stack_size(task);
+        if (recommended) {
+            printf(" %11u%s\n", recommended, task->handle ? "" : " (exited)");
+        } else {
+            printf(" %11s%s\n", "-", task->handle ? "" : " (exited)");
+        }
+    }
+
+    if (samples_skipped)
+        printf("%u samples skipped, more than %d tasks\n", samples_skipped, TASK_MONITOR_MAX_TASKS);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <FreeRTOS.h>
+#include <task.h>
+
+
+// With configUSE_TRACE_FACILITY every task in the system is sampled, SDK,
+// lwIP and HomeKit ones included. Samples of more tasks are skipped.
+#ifndef TASK_MONITOR_MAX_TASKS
+#if configUSE_TRACE_FACILITY
+#define TASK_MONITOR_MAX_TASKS 20
+#else
+#define TASK_MONITOR_MAX_TASKS 12
+#endif
+#endif
+
+// Headroom added to the deepest stack use seen when recommending a stack
+// size: percent of used words, but no less than TASK_MONITOR_MIN_MARGIN words
+#ifndef TASK_MONITOR_MARGIN
+#define TASK_MONITOR_MARGIN 25
+#endif
+
+#ifndef TASK_MONITOR_MIN_MARGIN
+#define TASK_MONITOR_MIN_MARGIN 64
+#endif
+
+#define TASK_MONITOR_NAME_SIZE 16
+
+// Stack sizes and free space are in words (StackType_t), CPU load in
+// per mille of time between the last two samples. Tasks not created
+// through task_monitor_add() (e.g. HomeKit server) are only seen with
+// configUSE_TRACE_FACILITY, CPU load needs configGENERATE_RUN_TIME_STATS
+// (build with TASK_STATS=1).
+typedef struct {
+    char name[TASK_MONITOR_NAME_SIZE];
+    TaskHandle_t handle;      // NULL once the task is gone
+    uint16_t stack_size;      // 0 if unknown
+    uint16_t stack_free_min;  // UINT16_MAX until sampled
+    uint32_t run_time;
+    uint16_t cpu;
+} task_monitor_task_t;
+
+
+// Track a task created with given stack size. Tasks created again under
+// the same name (e.g. identify) share an entry and keep its high-water mark.
+void task_monitor_add(TaskHandle_t handle, const char *name, uint16_t stack_size);
+
+// Record high-water mark of the calling task and stop tracking it. Call
+// right before a task deletes itself.
+void task_monitor_exit();
+
+// Update high-water marks and CPU load of all tasks
+void task_monitor_sample();
+
+// Number of samples skipped because there were more than
+// TASK_MONITOR_MAX_TASKS tasks
+uint32_t task_monitor_skipped();
+
+// Copy of tracked tasks, returns their number
+int task_monitor_get(task_monitor_task_t *tasks, int max_tasks);
+
+// Stack size that covers the deepest use seen plus margin, rounded up to
+// 32 words, 0 if unknown
+uint16_t task_monitor_recommended_stack_size(const task_monitor_task_t *task);
+
+// Sample and print a table of tasks with recommended stack sizes
+void task_monitor_print();
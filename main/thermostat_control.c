@@ -0,0 +1,83 @@
+#include <string.h>
+
+#include "thermostat_control.h"
+
+
+void thermostat_control_init(thermostat_control_t *control, float heat_band, float cool_band,
+                             uint32_t min_dwell) {
+    memset(control, 0, sizeof(*control));
+    control->heat_band = heat_band;
+    control->cool_band = cool_band;
+    control->min_dwell = min_dwell;
+}
+
+
+static thermostat_mode_t naive_mode(float temperature, float target) {
+    if (temperature < target)
+        return thermostat_mode_heat;
+    if (temperature > target)
+        return thermostat_mode_cool;
+    return thermostat_mode_fan;
+}
+
+static thermostat_mode_t hysteresis_mode(const thermostat_control_t *control,
+                                         float temperature, float target) {
+    if (temperature <= target - control->heat_band)
+        return thermostat_mode_heat;
+    if (temperature >= target + control->cool_band)
+        return thermostat_mode_cool;
+
+    // Inside the band: keep going until target is reached
+    switch (control->mode) {
+    case thermostat_mode_heat:
+        return (temperature < target) ? thermostat_mode_heat : thermostat_mode_fan;
+    case thermostat_mode_cool:
+        return (temperature > target) ? thermostat_mode_cool : thermostat_mode_fan;
+    default:
+        return thermostat_mode_fan;
+    }
+}
+
+
+bool thermostat_control_update(thermostat_control_t *control, float temperature, float target,
+                               uint32_t now) {
+    control->updates++;
+
+    thermostat_mode_t naive = naive_mode(temperature, target);
+    if (!control->valid) {
+        control->valid = true;
+        control->naive_mode = naive;
+        control->mode = hysteresis_mode(control, temperature, target);
+        control->mode_time = now;
+        return true;
+    }
+
+    if (naive != control->naive_mode) {
+        control->naive_mode = naive;
+        control->naive_transitions++;
+    }
+
+    thermostat_mode_t mode = hysteresis_mode(control, temperature, target);
+    if (mode == control->mode)
+        return false;
+
+    if (now - control->mode_time < control->min_dwell) {
+        control->dwell_holds++;
+        return false;
+    }
+
+    control->mode = mode;
+    control->mode_time = now;
+    control->transitions++;
+
+    return true;
+}
+
+
+const char *thermostat_mode_string(thermostat_mode_t mode) {
+    switch (mode) {
+    case thermostat_mode_heat: return "heat";
+    case thermostat_mode_cool: return "cool";
+    default: return "fan";
+    }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+// Local control loop for AUTO mode: decides from sensor readings whether
+// the AC should heat, cool or just run the fan, instead of leaving it to
+// the AC's own auto mode. 0 disables.
+#ifndef THERMOSTAT_CONTROL
+#define THERMOSTAT_CONTROL 0
+#endif
+
+// Degrees C below target at which heating starts and above target at
+// which cooling starts. Either stops once target is reached.
+#ifndef THERMOSTAT_HEAT_BAND
+#define THERMOSTAT_HEAT_BAND 1.0
+#endif
+
+#ifndef THERMOSTAT_COOL_BAND
+#define THERMOSTAT_COOL_BAND 1.0
+#endif
+
+// Seconds to stay in a mode before switching to another one
+#ifndef THERMOSTAT_MIN_DWELL
+#define THERMOSTAT_MIN_DWELL 300
+#endif
+
+
+typedef enum {
+    thermostat_mode_fan = 0,
+    thermostat_mode_heat,
+    thermostat_mode_cool,
+} thermostat_mode_t;
+
+typedef struct {
+    float heat_band;
+    float cool_band;
+    uint32_t min_dwell;       // ms
+
+    bool valid;               // got at least one reading
+    thermostat_mode_t mode;
+    uint32_t mode_time;       // ms, when mode was entered
+
+    // What switching on every reading (heat below target, cool above)
+    // would have done, to count transitions avoided
+    thermostat_mode_t naive_mode;
+
+    uint32_t updates;
+    uint32_t transitions;
+    uint32_t naive_transitions;
+    uint32_t dwell_holds;     // updates that wanted a transition before min_dwell
+} thermostat_control_t;
+
+
+void thermostat_control_init(thermostat_control_t *control, float heat_band, float cool_band,
+                             uint32_t min_dwell);
+
+// Feed a reading (or a new target), now in ms. Returns true if mode changed.
+bool thermostat_control_update(thermostat_control_t *control, float temperature, float target,
+                               uint32_t now);
+
+// Transitions saved compared to switching on every reading
+static inline uint32_t thermostat_control_avoided(const thermostat_control_t *control) {
+    return control->naive_transitions > control->transitions ?
+        control->naive_transitions - control->transitions : 0;
+}
+
+const char *thermostat_mode_string(thermostat_mode_t mode);
@@ -0,0 +1,50 @@
+#include <stdio.h>
+
+#include <FreeRTOS.h>
+#include <task.h>
+#include <espressif/esp_system.h>
+
+#include "trace.h"
+
+
+#if (TRACE_SIZE & (TRACE_SIZE - 1)) != 0
+#error "TRACE_SIZE must be a power of two"
+#endif
+
+static trace_record_t trace_records[TRACE_SIZE];
+static uint32_t trace_pos = 0;
+
+
+void trace(trace_event_t event, uint16_t arg, int8_t error) {
+    uint32_t timestamp = sdk_system_get_time();
+
+    taskENTER_CRITICAL();
+    trace_record_t *record = &trace_records[trace_pos++ & (TRACE_SIZE - 1)];
+    record->timestamp = timestamp;
+    record->event = event;
+    record->error = error;
+    record->arg = arg;
+    taskEXIT_CRITICAL();
+}
+
+
+void trace_dump() {
+    taskENTER_CRITICAL();
+    uint32_t end = trace_pos;
+    taskEXIT_CRITICAL();
+
+    uint32_t start = (end > TRACE_SIZE) ? end - TRACE_SIZE : 0;
+
+    printf("TRACE BEGIN %u %u\n", end - start, start);
+    for (uint32_t i=start; i < end; i++) {
+        trace_record_t record;
+
+        taskENTER_CRITICAL();
+        record = trace_records[i & (TRACE_SIZE - 1)];
+        taskEXIT_CRITICAL();
+
+        printf("TRACE %08x%02x%02x%04x\n",
+               record.timestamp, record.event, (uint8_t)record.error, record.arg);
+    }
+    printf("TRACE END\n");
+}
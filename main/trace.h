@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+
+
+// Trace events, X(name)
+#define TRACE_EVENTS(X) \
+    X(boot) \
+    X(ir_send) \
+    X(ir_send_failed) \
+    X(ir_decoded) \
+    X(ir_decode_failed) \
+    X(ir_echo) \
+    X(homekit_write) \
+    X(remote_state) \
+    X(notify_flush) \
+    X(sensor_reading) \
+    X(sensor_failed) \
+    X(ir_nec) \
+    X(ir_send_suppressed) \
+    X(sensor_deferred) \
+    X(ir_send_timer) \
+    X(model_detected)
+
+typedef enum {
+#define TRACE_EVENT_ENUM(name) trace_##name,
+    TRACE_EVENTS(TRACE_EVENT_ENUM)
+#undef TRACE_EVENT_ENUM
+    trace_event_count,
+} trace_event_t;
+
+
+// Compact trace record. Meaning of arg depends on event: packed AC state
+// (see fujitsu_ac_state_compact()) for IR events, unit << 8 | input id for
+// HomeKit writes, temperature in 0.1C for sensor readings, times a sensor
+// read was put off for IR, address << 8 | command for NEC remote, timer
+// minutes (error holds timer type) for timer frames, unit << 8 | model
+// for detected models.
+typedef struct {
+    uint32_t timestamp;  // us since boot
+    uint8_t event;
+    int8_t error;
+    uint16_t arg;
+} trace_record_t;
+
+
+// Number of records kept, must be a power of two
+#ifndef TRACE_SIZE
+#define TRACE_SIZE 128
+#endif
+
+
+void trace(trace_event_t event, uint16_t arg, int8_t error);
+
+// Print all records over serial as hex lines between "TRACE BEGIN" and
+// "TRACE END", oldest first. Decode with host/tracedump.
+void trace_dump();